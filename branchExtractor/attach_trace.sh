@@ -0,0 +1,20 @@
+#!/bin/bash
+# Usage: attach_trace.sh <pid> <trace_name> [window_ms]
+BRANCH_EXT_ROOT=$(dirname $(realpath -s $0))
+OUT=$(realpath -m "$2")
+# The tool runs inside the target, so the sidecar goes to its working directory
+TARGET_CWD=$(readlink /proc/$1/cwd)
+
+make -C ${BRANCH_EXT_ROOT}
+
+# Attach to the running process and trace it from now on, for window_ms
+# milliseconds (10 s by default) or 10M conditional branches, whichever
+# comes first; then detach and leave it running natively
+${BRANCH_EXT_ROOT}/pin_tool/pin -pid $1 -t ${BRANCH_EXT_ROOT}/obj-intel64/branchExt.so -b 1 -window_ms ${3:-10000} -detach 1 -o "$OUT"
+
+# Pin returns once it has attached; the dictionary is written last, on detach
+while [ ! -f "$OUT.dict" ]; do sleep 1; done
+sleep 1
+
+mv "${OUT}_0.out.bz2" "$OUT.bz2"
+mv "$TARGET_CWD/generalInfo_0.out" "$OUT.txt"
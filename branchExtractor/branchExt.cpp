@@ -47,6 +47,7 @@ END_LEGAL */
 // (T-N), (Con-Uncon), (Call-NotCall), (Ret-NotRet), (Direct-NotDirect), (first_inst_count_after_offset)
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <cstdio>
 #include <cstring>
 #include <iostream>
@@ -54,147 +55,1802 @@ END_LEGAL */
 #include <iomanip>
 #include <fstream>
 #include <cstdlib>
+#include <new>
 #include <map>
+#include <deque>
+#include <vector>
+#include <set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <bzlib.h>
 #include "pin.H"
 #include "instlib.H"
+#include "control_manager.H"
+#include "trace_format.h"
+#include "trace_shm.h"
+#ifdef ONLINE_PREDICTOR
+#undef STATIC // a storage class in pin.H, a predictor type in predictor.h
+#include "predictor.h"
+#endif
 
 using namespace std;
+using namespace CONTROLLER;
 
 #define axuliryFileName "generalInfo"
-std::map<ADDRINT, std::string> disAssemblyMap;
 
 static ADDRINT dl_debug_state_Addr = 0;
 static ADDRINT dl_debug_state_AddrEnd = 0;
 static BOOL justFoundDlDebugState = FALSE;
 
-ofstream OutFile;
-ofstream axuFile;
-// The running count of instructions is kept here
-// make it static to help the compiler optimize docount
-static UINT64 icount = 0;
-static UINT64 cbcount = 0;
-static UINT64 ubcount = 0;
-static UINT64 callcount = 0;
-static UINT64 retcount = 0;
-static int64_t howManyBranch = 0;
 static UINT64 howManySet = 0;
-static UINT64 fileCounter = 0;
-static UINT64 offset_inst = 0;
-static UINT64 first_inst_count_after_offset = 0;
-static bool first_record = true;
+static UINT64 maxCondBranches = 0;
+static UINT64 samplePeriod = 0;
+static UINT64 tracedRegions = 0; // regions finished by all threads
+
+// True while at least one thread is inside a region. Branches are only
+// instrumented then, outside of the regions the tool adds no instrumentation
 static bool record = false;
-static ostringstream filePrefix;
+static UINT32 recordingThreads = 0;
+static BOOL allThreads = FALSE; // inside a region broadcast to all threads
+static BOOL detaching = FALSE;  // the last region is done, no new ones start
+static string processSuffix;    // _p<pid> after the output prefixes with -follow_child
+
+// The regions are selected by the InstLib controller: -skip/-length,
+// -start_address/-stop_address, -control and -regions:in
+static CONTROL_MANAGER control;
+
+// The code that is traced is selected by the InstLib filter, -filter_rtn and
+// -filter_no_shared_libs, and by -filter_img and -filter_range
+static INSTLIB::FILTER filter;
+
+KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool", "o", "branches", "specifies the output file name prefix.");
+
+KNOB<string> KnobHowManySet(KNOB_MODE_WRITEONCE, "pintool", "b", "0", "Exits after this many regions have been traced, 0 to run the program to its end.");
+
+KNOB<BOOL> KnobDetach(KNOB_MODE_WRITEONCE, "pintool", "detach", "0", "Detaches after the last region (-b) instead of exiting, so the program runs to its end natively.");
+
+KNOB<UINT64> KnobMaxCondBranches(KNOB_MODE_WRITEONCE, "pintool", "max_cond_branches", "10000000", "Ends a region after this many conditional branches, 0 for no limit.");
+
+KNOB<UINT64> KnobWindowMs(KNOB_MODE_WRITEONCE, "pintool", "window_ms", "0", "Ends the trace this many milliseconds of wall-clock time after the first region started, 0 for no limit. With -detach the program then runs on natively (for Pin's -pid attach mode).");
+
+KNOB<UINT32> KnobProgressMs(KNOB_MODE_WRITEONCE, "pintool", "progress_ms", "1000", "Prints the branches of every thread in a region this often, in milliseconds of wall-clock time; 0 for never.");
+
+KNOB<UINT64> KnobSamplePeriod(KNOB_MODE_WRITEONCE, "pintool", "sample_period", "0", "Starts a region every N instructions of a thread, each of -max_cond_branches conditional branches (periodic sampling), 0 for off.");
+
+KNOB<BOOL> KnobFollowChild(KNOB_MODE_WRITEONCE, "pintool", "follow_child", "0", "Also traces the processes the program forks and, with Pin's -follow_execv, execs; each one writes <o>_p<pid>_* files listed in <o>.manifest.");
+
+KNOB<string> KnobFilterImage(KNOB_MODE_APPEND, "pintool", "filter_img", "", "Only traces the code of this image, by path or file name; repeat for more images.");
+
+KNOB<string> KnobFilterRange(KNOB_MODE_APPEND, "pintool", "filter_range", "", "Only traces the code in this address range, <start>:<end> in hex; repeat for more ranges.");
+
+KNOB<BOOL> KnobPredicated(KNOB_MODE_WRITEONCE, "pintool", "predicated", "0", "Also records the CMOVcc and SETcc instructions with the outcome of their condition.");
+
+KNOB<BOOL> KnobRep(KNOB_MODE_WRITEONCE, "pintool", "rep", "0", "Also records the REP string instructions with their iteration count.");
+
+KNOB<UINT32> KnobLoads(KNOB_MODE_WRITEONCE, "pintool", "loads", "0", "Records up to N loads of each conditional branch's block that its condition depends on, to <o>_<set>.loads; 0 for none.");
+
+KNOB<BOOL> KnobLoadValues(KNOB_MODE_WRITEONCE, "pintool", "load_values", "0", "With -loads, also records the first 8 bytes every load reads.");
+
+KNOB<BOOL> KnobIndex(KNOB_MODE_WRITEONCE, "pintool", "index", "0", "Writes <o>_<set>.idx, the branch, instruction count and file offset every block of the trace starts at, so the simulator can --seek into it.");
+
+KNOB<BOOL> KnobContext(KNOB_MODE_WRITEONCE, "pintool", "context", "0", "Writes the call context (function, call path hash and depth) in front of every conditional branch whose context changed.");
+
+KNOB<BOOL> KnobTextOutput(KNOB_MODE_WRITEONCE, "pintool", "text", "0", "Writes the trace as text lines instead of binary records.");
+
+KNOB<BOOL> KnobDictionary(KNOB_MODE_WRITEONCE, "pintool", "dict", "1", "Writes the static branches to <o>.dict at exit and, in binary traces, only their ids in the records.");
+
+KNOB<string> KnobShm(KNOB_MODE_WRITEONCE, "pintool", "shm", "", "Streams the main thread's trace into the shared-memory ring of a running 'predictor --shm=<name>' instead of a file.");
+
+#ifdef ONLINE_PREDICTOR
+KNOB<string> KnobPredictor(KNOB_MODE_WRITEONCE, "pintool", "predictor", "gshare", "Predictor evaluated in the tool: static, gshare, tournament or custom.");
+
+KNOB<UINT64> KnobInterval(KNOB_MODE_WRITEONCE, "pintool", "interval", "0", "Writes the mispredictions of every N conditional branches to <o>_<set>.csv, 0 for none.");
+#endif
+
+KNOB<UINT32> KnobNumPagesInBuffer(KNOB_MODE_WRITEONCE, "pintool", "num_pages_in_buffer", "256", "Number of 4KB pages in the trace buffer.");
+
+KNOB<string> KnobCompress(KNOB_MODE_WRITEONCE, "pintool", "compress", "bz2", "Compresses the trace while it is written: bz2 or none.");
+
+KNOB<UINT32> KnobWriters(KNOB_MODE_WRITEONCE, "pintool", "writers", "1", "Number of threads that compress and write the trace; each set goes to one of them, so up to N sets are compressed at once.");
+
+/************
+ *
+ * Trace buffer
+ *
+ * Branches are recorded into a Pin trace buffer by inlined code and only
+ * written out, with one large write, when the buffer is full.
+ */
+
+// Record written into the trace buffer for every branch
+struct BRANCH_RECORD
+{
+    ADDRINT pc;     // not filled with -dict
+    ADDRINT target; // with -dict only filled for indirect branches; the count
+                    // of a REP, the flags register before a CMOVcc/SETcc, the
+                    // address of a load
+    UINT64 icount;  // instructions of the thread up to and including the branch;
+                    // the value of a load
+    UINT32 flags;   // TRACE_* bits, the condition code of a CMOVcc/SETcc and the length
+    UINT32 id;      // static branch id in the dictionary
+    BOOL taken;
+};
+
+// The instruction length is a constant of the instrumentation, so it is
+// stored above the trace flags instead of in a field of its own, as is the
+// condition code of a predicated instruction. Its outcome is only
+// evaluated from the flags register when the record is written out
+#define RECORD_CC_SHIFT 16
+#define RECORD_LENGTH_SHIFT 24
+
+// A load of -loads, which goes to the side stream instead of the trace.
+// Its length bits hold the size of the load
+#define RECORD_LOAD (1 << 20)
+
+// Every region is written to a set of files of its own. The set is opened
+// and closed by BufferFull once the first `records` branches recorded into
+// the buffer have been written out, so the branches still waiting in the
+// buffer go to the set they belong to.
+struct SET_EVENT
+{
+    UINT64 records;
+    BOOL open;           // open set `set`, or close the open one
+    UINT64 set;
+    UINT64 instructions; // instruction count of the closed set, or the
+                         // icount the opened set starts at
+    UINT64 warmup;       // warmup and prolog branches of the closed set
+    string name;         // region name of the opened set, with -regions:in
+};
+
+static BUFFER_ID bufId;
+static BOOL compactRecords = FALSE; // binary records with dictionary ids
+static UINT32 loadSlice = 0;        // loads recorded per conditional branch, -loads
+
+/************
+ *
+ * Static branch dictionary
+ *
+ * Every branch instruction gets an id the first time it is instrumented.
+ * The id, address, class, target, fallthrough, image, routine and
+ * disassembly of all the branches are written to <o>.dict at exit (the
+ * format is described in trace_format.h), so the records of a binary trace
+ * only need the id, the outcome and the target of indirect branches.
+ */
+
+struct STATIC_BRANCH
+{
+    ADDRINT pc;
+    ADDRINT target; // 0 for indirect branches
+    ADDRINT fallthrough;
+    UINT32 flags;
+    UINT32 length;
+    string image;
+    string routine;
+    string disassembly;
+};
+
+// Only changed by the instrumentation, which Pin serializes
+static vector<STATIC_BRANCH> staticBranches;
+static map<ADDRINT, UINT32> branchIds;
+
+// Id of the branch `ins`, registering it on its first instrumentation.
+// Code that is re-instrumented (after PIN_RemoveInstrumentation) keeps its id
+static UINT32 branch_id(INS ins, UINT32 flags)
+{
+    ADDRINT pc = INS_Address(ins);
+    map<ADDRINT, UINT32>::iterator it = branchIds.find(pc);
+    if (it != branchIds.end())
+        return it->second;
+
+    STATIC_BRANCH branch;
+    branch.pc = pc;
+    branch.target = INS_IsDirectControlFlow(ins) ? INS_DirectControlFlowTargetAddress(ins) : 0;
+    branch.fallthrough = INS_NextAddress(ins);
+    branch.flags = flags;
+    branch.length = INS_Size(ins);
+    IMG img = IMG_FindByAddress(pc);
+    branch.image = IMG_Valid(img) ? IMG_Name(img) : "?";
+    branch.routine = RTN_FindNameByAddress(pc);
+    if (branch.routine.empty())
+        branch.routine = "?";
+    branch.disassembly = INS_Disassemble(ins);
+
+    UINT32 id = staticBranches.size();
+    staticBranches.push_back(branch);
+    branchIds[pc] = id;
+    return id;
+}
+
+static const char *branch_class(UINT32 flags)
+{
+    if (flags & TRACE_PREDICATED)
+        return "predicated";
+    if (flags & TRACE_REP)
+        return "rep";
+    if (flags & TRACE_RET)
+        return "ret";
+    if (flags & TRACE_COND)
+        return "cond";
+    if (flags & TRACE_CALL)
+        return (flags & TRACE_DIRECT) ? "call" : "call-indirect";
+    return (flags & TRACE_DIRECT) ? "jump" : "jump-indirect";
+}
+
+static VOID write_dictionary()
+{
+    if (!KnobDictionary)
+        return;
+
+    ofstream dictFile((KnobOutputFile.Value() + processSuffix + ".dict").c_str());
+    dictFile << "# id\tpc\tflags\tclass\tlength\ttarget\tfallthrough\timage\troutine\tdisassembly" << endl;
+    char line[64];
+    for (UINT32 id = 0; id < staticBranches.size(); id++)
+    {
+        const STATIC_BRANCH &branch = staticBranches[id];
+        sprintf(line, "%u\t0x%llx\t0x%x\t", id, (unsigned long long)branch.pc, branch.flags);
+        dictFile << line << branch_class(branch.flags);
+        sprintf(line, "\t%u\t0x%llx\t0x%llx\t", branch.length,
+                (unsigned long long)branch.target, (unsigned long long)branch.fallthrough);
+        dictFile << line << branch.image << "\t" << branch.routine << "\t" << branch.disassembly << "\n";
+    }
+    dictFile.close();
+}
+
+/************
+ *
+ * Thread data
+ *
+ * Every application thread is traced on its own: it has its own trace
+ * buffer, counters, sets and output files, so threads never share state
+ * on the instrumentation path. Thread 0 writes branches_N.out and
+ * generalInfo_N.out as before, thread T writes branches_tT_N.out and
+ * generalInfo_tT_N.out.
+ *
+ * The data is kept in Pin TLS and, for the inlined analysis routines, in a
+ * tool register so they can reach it without a call. The instruction
+ * count lives in a second tool register, so the trace buffer can record it
+ * with every branch.
+ */
+
+struct THREAD_DATA
+{
+    // Updated by the inlined analysis routines
+    UINT64 cbcount;         // conditional branches of the current region,
+                            // also read by ProgressThread (relaxed atomics)
+    UINT64 reccount;        // branches recorded into the buffer
+    UINT64 nextBranchEvent; // -max_cond_branches, or 0 to end the region now
+    ADDRINT record;         // 1 while the thread is inside a region
+    UINT64 nextWindow;      // icount of the next -sample_period window
+
+    THREADID tid;
+    UINT64 regions;           // regions started, numbers the sets without -regions:in
+    UINT64 startInstructions; // icount when the current region started
+    UINT64 startRecords;      // reccount when the current region started
+    UINT64 warmupRecords;     // branches of the current region before EVENT_START
+    BOOL closed;              // the last set has been closed at exit
+    VOID *bufferBase;         // the trace buffer, always handed back by BufferFull
+
+    // Updated by BufferFull
+    UINT64 fileCounter; // set of the open files
+    BOOL open;
+    UINT64 ubcount;
+    UINT64 callcount;
+    UINT64 retcount;
+    UINT64 setcbcount;
+    UINT64 takencount;       // taken conditional branches
+    UINT64 indirectcount;    // indirect jumps
+    UINT64 indirectcallcount;
+    UINT64 staticcount;      // static branches of the set
+    UINT64 staticcbcount;
+    vector<UINT8> seenIds;   // static branches of the set, by dictionary id
+    set<ADDRINT> seenPcs;    // or by address with -dict 0
+    UINT64 flushedcount; // branches written out by BufferFull
+    UINT64 progressCount; // cbcount at the last progress report, only read and
+                          // written by ProgressThread
+    UINT64 discardcount; // branches of the parent left in the buffer of a fork child
+    UINT64 lastIcount;   // icount of the last branch written out
+    UINT64 setStart;     // icount the open set started at
+    deque<SET_EVENT> setEvents;
+
+    ofstream *outFile;  // of the open set, deleted by the writer when it closes it
+    ofstream axuFile;
+    ofstream *loadFile; // -loads side stream of the open set, as outFile
+    ofstream *indexFile; // -index of the open set, as outFile
+    UINT64 setBytes;    // uncompressed bytes of the trace of the open set
+    UINT32 writer;      // writer thread of the open set
+    string regionName;  // of the open set, with -regions:in
+    UINT64 setBranches; // branch records written to the trace of the open set
+    vector<trace_load_record> loads; // of the block being encoded
+
+    // -context, followed through the calls and returns of the open set
+    UINT64 contextFunction;
+    UINT64 contextHash;
+    vector<pair<UINT64, UINT64> > callStack; // function and hash of the callers
+    BOOL contextChanged;
+
+#ifdef ONLINE_PREDICTOR
+    // Predictor statistics of the open set, updated by BufferFull
+    UINT64 predBranches;
+    UINT64 predMispredictions;
+    UINT64 predInsts;
+    UINT64 intervals;
+    UINT64 intervalBranches; // predBranches, predMispredictions and predInsts
+    UINT64 intervalMispredictions; // when the current interval started
+    UINT64 intervalInsts;
+    ofstream intervalFile;
+#endif
+};
+
+static TLS_KEY tlsKey;
+static REG tlsReg;
+static REG icountReg; // instructions executed while branches are instrumented
+static REG valueReg;  // value of the load being recorded, with -load_values
+
+static PIN_MUTEX threadLock;
+static vector<THREAD_DATA *> threads; // every thread seen, for Fini
+
+static THREAD_DATA *get_thread_data(THREADID tid)
+{
+    return static_cast<THREAD_DATA *>(PIN_GetThreadData(tlsKey, tid));
+}
+
+#ifndef ONLINE_PREDICTOR
+/************
+ *
+ * Live trace ring
+ *
+ * With -shm the trace of the main thread is not written to a file but into
+ * the shared-memory ring (src/trace_shm.h) of a simulator that runs at the
+ * same time. The writer waits while the ring is full, so no branch is lost
+ * and the program runs at the speed of the simulator. The bytes are those
+ * of one uncompressed trace file: one header, then the branches of all the
+ * sets. The records are full ones, as the dictionary is only written at
+ * exit.
+ */
+
+#define SHM_SLEEP_MS 1
+
+static trace_shm_header *shmRing = NULL;
+static char *shmData = NULL;
+static BOOL shmHeaderSent = FALSE;
+
+// Maps the ring the simulator has created
+static BOOL attach_shm(const string &name)
+{
+    int fd = open((TRACE_SHM_DIR + name).c_str(), O_RDWR);
+    if (fd < 0)
+        return FALSE;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(trace_shm_header))
+    {
+        close(fd);
+        return FALSE;
+    }
+    VOID *mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return FALSE;
+
+    shmRing = (trace_shm_header *)mem;
+    shmData = (char *)mem + sizeof(trace_shm_header);
+    return __atomic_load_n(&shmRing->magic, __ATOMIC_ACQUIRE) == TRACE_SHM_MAGIC &&
+           sizeof(trace_shm_header) + shmRing->size <= (size_t)st.st_size;
+}
+
+// Copies `size` bytes into the ring, waiting for the simulator to make room
+static VOID shm_write(const char *data, UINT64 size)
+{
+    UINT64 head = shmRing->head;
+    while (size > 0)
+    {
+        UINT64 space = shmRing->size - (head - __atomic_load_n(&shmRing->tail, __ATOMIC_ACQUIRE));
+        if (space == 0)
+        {
+            PIN_Sleep(SHM_SLEEP_MS);
+            continue;
+        }
+
+        UINT64 offset = head & (shmRing->size - 1);
+        UINT64 n = size;
+        if (n > space)
+            n = space;
+        if (n > shmRing->size - offset)
+            n = shmRing->size - offset;
+        memcpy(shmData + offset, data, n);
+        head += n;
+        __atomic_store_n(&shmRing->head, head, __ATOMIC_RELEASE);
+
+        data += n;
+        size -= n;
+    }
+}
+
+// Tells the simulator the trace is complete, after the writer has stopped
+static VOID finish_shm()
+{
+    if (shmRing != NULL)
+        __atomic_store_n(&shmRing->done, 1, __ATOMIC_RELEASE);
+}
+
+/************
+ *
+ * Output writer
+ *
+ * The encoded branches are handed over in blocks to internal Pin threads,
+ * which compress and write them while the application keeps running.
+ * With -compress bz2 every block is a complete bz2 stream of its own: the
+ * file is a concatenation of streams that bunzip2 reads as one, and each
+ * block can be decoded independently of the others.
+ *
+ * With -writers N there are N writer threads. Every set is given to one of
+ * them, in turn, when it is opened, so the blocks of a file are written in
+ * order while the sets of other regions and threads are compressed at the
+ * same time. Each set has streams of its own, which the writer deletes when
+ * it closes them, so a set can still be written while the next one is open.
+ */
+
+#define WRITER_BLOCKS 4 // blocks in flight per writer, bounds the memory of a slow compressor
+#define MAX_TEXT_LINE 60 // bytes of the longest text line, a context record
+
+struct OUTPUT_BLOCK
+{
+    vector<char> data;
+    UINT64 size;
+    UINT32 writer;   // writer thread of the set
+    ofstream *file;  // trace file of the set the branches belong to, NULL for the ring
+    string openFile; // when set, the file is opened first
+    BOOL closeFile;  // close and delete the file after writing the block
+    BOOL raw;        // written as is, even with -compress bz2
+    ofstream *indexFile;     // -index of the set, gets an entry for the block
+    trace_index_entry entry; // with the offset in the file left to the writer
+};
+
+struct WRITER
+{
+    deque<OUTPUT_BLOCK *> queue; // submitted blocks, in file order
+    BOOL running;
+    PIN_THREAD_UID uid;
+    PIN_SEMAPHORE blockReady;
+    vector<char> compressBuffer;
+};
+
+static vector<OUTPUT_BLOCK> writerBlocks;
+static vector<OUTPUT_BLOCK *> freeBlocks;
+static vector<WRITER> writers;
+static UINT32 nextWriter = 0; // writer of the next set
+static BOOL writerStop = FALSE;
+static PIN_MUTEX writerLock;
+static PIN_SEMAPHORE blockFree;
+
+static BOOL compressBz2 = FALSE;
+
+// Writes one block to the trace file, as a bz2 stream with -compress bz2
+static VOID write_block(OUTPUT_BLOCK *block)
+{
+    if (block->file == NULL)
+    {
+        shm_write(&block->data[0], block->size);
+        return;
+    }
+
+    if (!block->openFile.empty())
+        block->file->open(block->openFile.c_str(), ios::out | ios::binary);
+
+    if (block->indexFile != NULL)
+    {
+        block->entry.offset = block->file->tellp();
+        block->indexFile->write((const char *)&block->entry, sizeof(block->entry));
+    }
+
+    if (block->size > 0 && compressBz2 && !block->raw)
+    {
+        vector<char> &compressBuffer = writers[block->writer].compressBuffer;
+        bz_stream strm;
+        memset(&strm, 0, sizeof(strm));
+        BZ2_bzCompressInit(&strm, 9, 0, 0);
+        strm.next_in = &block->data[0];
+        strm.avail_in = block->size;
+
+        int ret;
+        do
+        {
+            strm.next_out = &compressBuffer[0];
+            strm.avail_out = compressBuffer.size();
+            ret = BZ2_bzCompress(&strm, BZ_FINISH);
+            block->file->write(&compressBuffer[0], compressBuffer.size() - strm.avail_out);
+        } while (ret == BZ_FINISH_OK);
+
+        BZ2_bzCompressEnd(&strm);
+    }
+    else if (block->size > 0)
+    {
+        block->file->write(&block->data[0], block->size);
+    }
+
+    if (block->closeFile)
+    {
+        block->file->close();
+        delete block->file;
+    }
+}
+
+// Root of an internal writer thread: writes the blocks submitted to it in
+// order until stop_writer is called and nothing is left in flight
+static VOID WriterThread(VOID *arg)
+{
+    WRITER *writer = (WRITER *)arg;
+
+    PIN_MutexLock(&writerLock);
+    while (TRUE)
+    {
+        while (writer->queue.empty() && !writerStop)
+        {
+            PIN_SemaphoreClear(&writer->blockReady);
+            PIN_MutexUnlock(&writerLock);
+            PIN_SemaphoreWait(&writer->blockReady);
+            PIN_MutexLock(&writerLock);
+        }
+        if (writer->queue.empty())
+            break;
+
+        OUTPUT_BLOCK *block = writer->queue.front();
+        PIN_MutexUnlock(&writerLock);
+        write_block(block);
+        PIN_MutexLock(&writerLock);
+
+        writer->queue.pop_front();
+        freeBlocks.push_back(block);
+        PIN_SemaphoreSet(&blockFree);
+    }
+    // Blocks submitted from now on are written by the submitting thread
+    writer->running = FALSE;
+    PIN_MutexUnlock(&writerLock);
+}
+
+// Picks the writer of a new set. The ring is a single stream, so it
+// always goes to the first one
+static UINT32 next_writer(BOOL ring)
+{
+    if (ring)
+        return 0;
+    PIN_MutexLock(&writerLock);
+    UINT32 writer = nextWriter++ % writers.size();
+    PIN_MutexUnlock(&writerLock);
+    return writer;
+}
+
+// Returns a free block for `writer`, waiting while all of them are in flight
+static OUTPUT_BLOCK *acquire_block(UINT32 writer)
+{
+    PIN_MutexLock(&writerLock);
+    while (freeBlocks.empty())
+    {
+        PIN_SemaphoreClear(&blockFree);
+        PIN_MutexUnlock(&writerLock);
+        PIN_SemaphoreWait(&blockFree);
+        PIN_MutexLock(&writerLock);
+    }
+    OUTPUT_BLOCK *block = freeBlocks.back();
+    freeBlocks.pop_back();
+    PIN_MutexUnlock(&writerLock);
+
+    block->size = 0;
+    block->writer = writer;
+    block->file = NULL;
+    block->openFile.clear();
+    block->closeFile = FALSE;
+    block->raw = FALSE;
+    block->indexFile = NULL;
+    return block;
+}
+
+static VOID submit_block(OUTPUT_BLOCK *block)
+{
+    WRITER *writer = &writers[block->writer];
+
+    PIN_MutexLock(&writerLock);
+    if (writer->running)
+    {
+        writer->queue.push_back(block);
+        PIN_SemaphoreSet(&writer->blockReady);
+    }
+    else
+    {
+        // Under the lock, as several application threads may flush at exit
+        write_block(block);
+        freeBlocks.push_back(block);
+        PIN_SemaphoreSet(&blockFree);
+    }
+    PIN_MutexUnlock(&writerLock);
+}
+
+// Allocates the blocks, each large enough for a full trace buffer in the
+// larger (text) encoding, and spawns the writer threads
+static VOID start_writer()
+{
+    UINT32 numWriters = (KnobWriters.Value() > 0) ? KnobWriters.Value() : 1;
+    UINT64 bufferRecords = (UINT64)KnobNumPagesInBuffer.Value() * 4096 / sizeof(BRANCH_RECORD);
+    // With -context a record may be preceded by a context record
+    UINT64 blockSize = bufferRecords * MAX_TEXT_LINE * (KnobContext ? 2 : 1);
+
+    writerBlocks.resize(WRITER_BLOCKS * numWriters);
+    for (UINT32 i = 0; i < writerBlocks.size(); i++)
+    {
+        writerBlocks[i].data.resize(blockSize);
+        freeBlocks.push_back(&writerBlocks[i]);
+    }
+
+    PIN_MutexInit(&writerLock);
+    PIN_SemaphoreInit(&blockFree);
+
+    // Not resized again, the threads and semaphores refer to the elements
+    writers.resize(numWriters);
+    for (UINT32 i = 0; i < numWriters; i++)
+    {
+        WRITER *writer = &writers[i];
+        // bz2 output is at most 1% larger than its input, plus a small header
+        writer->compressBuffer.resize(blockSize + blockSize / 100 + 600);
+        PIN_SemaphoreInit(&writer->blockReady);
+
+        writer->running = TRUE;
+        if (PIN_SpawnInternalThread(WriterThread, writer, 0, &writer->uid) == INVALID_THREADID)
+        {
+            // Its sets are written synchronously by the application threads instead
+            cerr << "Warning: could not spawn writer thread " << i << endl;
+            writer->running = FALSE;
+        }
+    }
+}
+
+// Writes out the blocks still in flight and ends the writer threads
+static VOID stop_writer()
+{
+    PIN_MutexLock(&writerLock);
+    vector<BOOL> running(writers.size());
+    writerStop = TRUE;
+    for (UINT32 i = 0; i < writers.size(); i++)
+    {
+        running[i] = writers[i].running;
+        PIN_SemaphoreSet(&writers[i].blockReady);
+    }
+    PIN_MutexUnlock(&writerLock);
+
+    for (UINT32 i = 0; i < writers.size(); i++)
+    {
+        if (running[i])
+            PIN_WaitForThreadTermination(writers[i].uid, PIN_INFINITE_TIMEOUT, NULL);
+    }
+}
+
+// In a fork child. The writer threads do not exist there and the blocks
+// in flight belong to the parent, so the child writes synchronously, and
+// never into the parent's ring
+static VOID reset_writer()
+{
+    PIN_MutexInit(&writerLock);
+    PIN_SemaphoreInit(&blockFree);
+    for (UINT32 i = 0; i < writers.size(); i++)
+    {
+        PIN_SemaphoreInit(&writers[i].blockReady);
+        writers[i].queue.clear();
+        writers[i].running = FALSE;
+    }
+    freeBlocks.clear();
+    for (UINT32 i = 0; i < writerBlocks.size(); i++)
+        freeBlocks.push_back(&writerBlocks[i]);
+
+    shmRing = NULL;
+}
+#else
+// branchExtPredict writes no trace
+static VOID start_writer() {}
+static VOID stop_writer() {}
+static VOID reset_writer() {}
+static VOID finish_shm() {}
+#endif
+
+/************
+ *
+ * Process tree
+ *
+ * With -follow_child every process of the tree writes files of its own,
+ * with _p<pid> after the prefix (_p<pid>_x<N> after the N-th exec of the
+ * same process). <o>.manifest ties them together, one line per process
+ * image:
+ *
+ *   event  pid  parent prefix  prefix
+ *
+ * where event is root, fork or exec and the parent prefix is "-" for the
+ * root. An image about to exec writes the exec line; the new image has the
+ * same pid and tool command line and takes its prefix from there.
+ */
+
+static string manifest_name()
+{
+    return KnobOutputFile.Value() + ".manifest";
+}
+
+// One write with O_APPEND, so the lines of the processes do not mix
+static VOID append_manifest(const char *event, const string &parent, const string &prefix, BOOL truncate)
+{
+    ostringstream line;
+    line << event << "\t" << PIN_GetPid() << "\t" << parent << "\t" << prefix << "\n";
+    string text = line.str();
+
+    int fd = open(manifest_name().c_str(), O_WRONLY | O_CREAT | (truncate ? O_TRUNC : O_APPEND), 0644);
+    if (fd < 0 || write(fd, text.c_str(), text.size()) != (ssize_t)text.size())
+        cerr << "Warning: could not write " << manifest_name() << endl;
+    if (fd >= 0)
+        close(fd);
+}
+
+// Names the process: the prefix an exec line left for this pid, or the
+// root of a new tree
+static VOID start_process_tree()
+{
+    string pid = decstr(PIN_GetPid());
+    string prefix;
+    ifstream manifest(manifest_name().c_str());
+    string line;
+    while (getline(manifest, line))
+    {
+        istringstream fields(line);
+        string event, linePid, parent, linePrefix;
+        getline(fields, event, '\t');
+        getline(fields, linePid, '\t');
+        getline(fields, parent, '\t');
+        getline(fields, linePrefix, '\t');
+        if (linePid == pid)
+            prefix = (event == "exec") ? linePrefix : "";
+    }
+    manifest.close();
+
+    if (!prefix.empty())
+    {
+        processSuffix = prefix.substr(KnobOutputFile.Value().size());
+        return;
+    }
+    processSuffix = "_p" + pid;
+    append_manifest("root", "-", KnobOutputFile.Value() + processSuffix, TRUE);
+}
+
+// <name>_<set>.out for thread 0, <name>_t<tid>_<set>.out for the others,
+// with _p<pid> after the name with -follow_child
+string output_name(THREAD_DATA *td, const string &name, const char *suffix = ".out")
+{
+    ostringstream fileName;
+    fileName << name << processSuffix << "_";
+    if (td->tid != 0)
+        fileName << "t" << td->tid << "_";
+    fileName << td->fileCounter << suffix;
+    return fileName.str();
+}
+
+#ifdef ONLINE_PREDICTOR
+/************
+ *
+ * Online predictor
+ *
+ * The branchExtPredict build links src/predictor.cpp into the tool. The
+ * branches of a full trace buffer are run through make_prediction and
+ * train_predictor in BufferFull instead of being written out, and only the
+ * statistics are: in the sidecar of every set and, with -interval, in
+ * <o>_<set>.csv with the columns of the simulator's --interval. The
+ * predictor has a single set of tables, so the threads take turns on it.
+ */
+
+static PIN_MUTEX predictorLock;
+
+// Writes the interval ending at the current counts
+static VOID write_interval(THREAD_DATA *td)
+{
+    UINT64 branches = td->predBranches - td->intervalBranches;
+    UINT64 mispredictions = td->predMispredictions - td->intervalMispredictions;
+    UINT64 insts = td->predInsts - td->intervalInsts;
+    char line[128];
+    sprintf(line, "%llu,%llu,%llu,%llu,%.3f,%llu,%.3f\n",
+            (unsigned long long)td->intervals, (unsigned long long)td->intervalBranches,
+            (unsigned long long)branches, (unsigned long long)mispredictions,
+            1000 * (double)mispredictions / (double)branches, (unsigned long long)insts,
+            (insts > 0) ? 1000 * (double)mispredictions / (double)insts : 0);
+    td->intervalFile << line;
+
+    td->intervals++;
+    td->intervalBranches = td->predBranches;
+    td->intervalMispredictions = td->predMispredictions;
+    td->intervalInsts = td->predInsts;
+}
+
+static VOID open_predictor_stats(THREAD_DATA *td)
+{
+    td->predBranches = 0;
+    td->predMispredictions = 0;
+    td->predInsts = 0;
+    td->intervals = 0;
+    td->intervalBranches = 0;
+    td->intervalMispredictions = 0;
+    td->intervalInsts = 0;
+    if (KnobInterval > 0)
+    {
+        td->intervalFile.open(output_name(td, KnobOutputFile.Value(), ".csv").c_str());
+        td->intervalFile << "interval,start,branches,incorrect,rate,instructions,mpki" << endl;
+    }
+}
+
+// Adds the result of the set to its sidecar
+static VOID write_predictor_stats(THREAD_DATA *td, UINT64 instructions)
+{
+    if (td->intervalFile.is_open())
+    {
+        if (td->predBranches != td->intervalBranches)
+            write_interval(td);
+        td->intervalFile.close();
+    }
+
+    char line[64];
+    td->axuFile << "!!! Predictor = " << bpName[bpType] << endl;
+    td->axuFile << "!!! Number of Mispredictions = " << td->predMispredictions << endl;
+    sprintf(line, "%.3f", 1000 * (double)td->predMispredictions / (double)(td->predBranches ? td->predBranches : 1));
+    td->axuFile << "!!! Misprediction Rate = " << line << endl;
+    sprintf(line, "%.3f", 1000 * (double)td->predMispredictions / (double)(instructions ? instructions : 1));
+    td->axuFile << "!!! MPKI = " << line << endl;
+
+    cout << "Thread " << td->tid << ": set " << td->fileCounter << " " << td->predMispredictions
+         << " of " << td->predBranches << " mispredicted, MPKI " << line << endl;
+}
+#endif
+
+VOID write_on_axu(THREAD_DATA *td, UINT64 instructions, UINT64 warmup)
+{
+    td->axuFile << "!!! Number of Instructions = " << instructions << endl;
+    td->axuFile << "!!! Number of Unconditional branches = " << td->ubcount << endl;
+    td->axuFile << "!!! Number of Conditional branches = " << td->setcbcount << endl;
+    td->axuFile << "!!! Number of Call branches = " << td->callcount << endl;
+    td->axuFile << "!!! Number of Ret branches = " << td->retcount << endl;
+    td->axuFile << "!!! Number of Indirect jumps = " << td->indirectcount << endl;
+    td->axuFile << "!!! Number of Indirect calls = " << td->indirectcallcount << endl;
+    td->axuFile << "!!! Number of Taken conditional branches = " << td->takencount << endl;
+    td->axuFile << "!!! Conditional taken ratio = " << fixed << setprecision(3)
+                << (td->setcbcount > 0 ? (double)td->takencount / td->setcbcount : 0.0) << endl;
+    td->axuFile << "!!! Static branches = " << td->staticcount << endl;
+    td->axuFile << "!!! Static conditional branches = " << td->staticcbcount << endl;
+    // Only with -regions:warmup or -regions:prolog, the branches in front of the region
+    if (warmup > 0)
+        td->axuFile << "!!! Number of Warmup branches = " << warmup << endl;
+    // Only with -regions:in, the region the set holds
+    if (!td->regionName.empty())
+        td->axuFile << "!!! Region = " << td->regionName << endl;
+    // Position of the window in the thread, with -sample_period. Between the
+    // regions of -regions:in the instructions are not counted
+    if (samplePeriod > 0)
+        td->axuFile << "!!! Window start instruction = " << td->setStart << endl;
+#ifdef ONLINE_PREDICTOR
+    write_predictor_stats(td, instructions);
+#endif
+
+    td->axuFile.close();
+}
+
+#ifndef ONLINE_PREDICTOR
+// True if the thread's trace goes to the ring
+static BOOL ring_thread(THREAD_DATA *td)
+{
+    return shmRing != NULL && td->tid == 0;
+}
+#endif
+
+VOID open_files(THREAD_DATA *td)
+{
+#ifdef ONLINE_PREDICTOR
+    open_predictor_stats(td);
+#else
+    td->writer = next_writer(ring_thread(td));
+    OUTPUT_BLOCK *block = acquire_block(td->writer);
+    BOOL writeHeader = TRUE;
+    if (!ring_thread(td))
+    {
+        td->outFile = new ofstream();
+        block->file = td->outFile;
+        block->openFile = output_name(td, KnobOutputFile.Value());
+        if (compressBz2)
+            block->openFile += ".bz2";
+    }
+    else
+    {
+        // One header in front of all the sets
+        writeHeader = !shmHeaderSent;
+        shmHeaderSent = TRUE;
+    }
+    if (!KnobTextOutput && writeHeader)
+    {
+        trace_header header = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record), 0};
+        if (compactRecords)
+        {
+            header.version = TRACE_VERSION_COMPACT;
+            header.record_size = sizeof(trace_compact_record);
+        }
+        memcpy(&block->data[0], &header, sizeof(header));
+        block->size = sizeof(header);
+    }
+    submit_block(block);
+
+    if (loadSlice > 0)
+    {
+        td->loadFile = new ofstream();
+        block = acquire_block(td->writer);
+        block->file = td->loadFile;
+        block->openFile = output_name(td, KnobOutputFile.Value(), ".loads");
+        if (compressBz2)
+            block->openFile += ".bz2";
+        trace_header header = {TRACE_MAGIC, TRACE_VERSION_LOADS, sizeof(trace_load_record), 0};
+        memcpy(&block->data[0], &header, sizeof(header));
+        block->size = sizeof(header);
+        submit_block(block);
+    }
+
+    if (KnobIndex && !ring_thread(td))
+    {
+        td->indexFile = new ofstream();
+        block = acquire_block(td->writer);
+        block->file = td->indexFile;
+        block->openFile = output_name(td, KnobOutputFile.Value(), ".idx");
+        block->raw = TRUE;
+        trace_header header = {TRACE_MAGIC, TRACE_VERSION_INDEX, sizeof(trace_index_entry), 0};
+        memcpy(&block->data[0], &header, sizeof(header));
+        block->size = sizeof(header);
+        submit_block(block);
+    }
+    td->setBranches = 0;
+    td->setBytes = (!KnobTextOutput && writeHeader) ? sizeof(trace_header) : 0;
+#endif
+
+    td->contextFunction = 0;
+    td->contextHash = 0;
+    td->callStack.clear();
+    td->contextChanged = TRUE;
+
+    td->axuFile.open(output_name(td, axuliryFileName).c_str());
+    td->axuFile.setf(ios::showbase);
+
+    td->open = TRUE;
+}
+
+// Writes the sidecar of the open set and closes its trace file
+VOID close_files(THREAD_DATA *td, UINT64 instructions, UINT64 warmup)
+{
+    write_on_axu(td, instructions, warmup);
+
+    td->ubcount = 0;
+    td->callcount = 0;
+    td->retcount = 0;
+    td->setcbcount = 0;
+    td->takencount = 0;
+    td->indirectcount = 0;
+    td->indirectcallcount = 0;
+    td->staticcount = 0;
+    td->staticcbcount = 0;
+    td->seenIds.clear();
+    td->seenPcs.clear();
+
+#ifndef ONLINE_PREDICTOR
+    OUTPUT_BLOCK *block = acquire_block(td->writer);
+    block->file = td->outFile;
+    block->closeFile = !ring_thread(td);
+    submit_block(block);
+    td->outFile = NULL;
+
+    if (loadSlice > 0)
+    {
+        block = acquire_block(td->writer);
+        block->file = td->loadFile;
+        block->closeFile = TRUE;
+        submit_block(block);
+        td->loadFile = NULL;
+    }
+
+    if (td->indexFile != NULL)
+    {
+        block = acquire_block(td->writer);
+        block->file = td->indexFile;
+        block->closeFile = TRUE;
+        submit_block(block);
+        td->indexFile = NULL;
+    }
+#endif
+
+    td->open = FALSE;
+}
+
+// True if condition code `cc` (the low nibble of the Jcc/CMOVcc/SETcc
+// opcode) holds for the flags register
+static BOOL condition_holds(UINT32 cc, ADDRINT eflags)
+{
+    BOOL cf = (eflags >> 0) & 1;
+    BOOL pf = (eflags >> 2) & 1;
+    BOOL zf = (eflags >> 6) & 1;
+    BOOL sf = (eflags >> 7) & 1;
+    BOOL of = (eflags >> 11) & 1;
+    BOOL holds;
+    switch (cc >> 1)
+    {
+    case 0: holds = of; break;            // O
+    case 1: holds = cf; break;            // B
+    case 2: holds = zf; break;            // Z
+    case 3: holds = cf || zf; break;      // BE
+    case 4: holds = sf; break;            // S
+    case 5: holds = pf; break;            // P
+    case 6: holds = sf != of; break;      // L
+    default: holds = zf || sf != of; break; // LE
+    }
+    // Odd codes are the negated conditions
+    return (cc & 1) ? !holds : holds;
+}
+
+// Follows a call or return of the thread for -context. The call path hash
+// mixes in the address of every call; a return restores the caller's.
+// Returns below the start of the set leave an unknown (0) context
+static VOID track_context(THREAD_DATA *td, UINT32 flags, const BRANCH_RECORD *rec)
+{
+    if (flags & TRACE_CALL)
+    {
+        td->callStack.push_back(make_pair(td->contextFunction, td->contextHash));
+        td->contextFunction = rec->target;
+        td->contextHash = (td->contextHash ^ rec->pc) * 0x9e3779b97f4a7c15ull;
+        td->contextChanged = TRUE;
+    }
+    else if (flags & TRACE_RET)
+    {
+        td->contextFunction = td->callStack.empty() ? 0 : td->callStack.back().first;
+        td->contextHash = td->callStack.empty() ? 0 : td->callStack.back().second;
+        if (!td->callStack.empty())
+            td->callStack.pop_back();
+        td->contextChanged = TRUE;
+    }
+}
+
+// Counts the first execution of a static branch in the set
+static VOID count_static(THREAD_DATA *td, const BRANCH_RECORD *rec, UINT32 flags)
+{
+    if (KnobDictionary)
+    {
+        if (rec->id >= td->seenIds.size())
+            td->seenIds.resize(rec->id + 1024);
+        if (td->seenIds[rec->id])
+            return;
+        td->seenIds[rec->id] = 1;
+    }
+    else if (!td->seenPcs.insert(rec->pc).second)
+    {
+        return;
+    }
+
+    td->staticcount++;
+    if (flags & TRACE_COND)
+        td->staticcbcount++;
+}
+
+// Counts the branch in the sidecar of the set. Returns its trace flags and
+// the instructions since the previous branch
+static UINT32 count_record(THREAD_DATA *td, const BRANCH_RECORD *rec, UINT64 *insts)
+{
+    UINT32 flags = rec->flags & ((1 << RECORD_CC_SHIFT) - 1);
+    *insts = rec->icount - td->lastIcount;
+    td->lastIcount = rec->icount;
+
+    // The taken field is only filled for branches
+    if (flags & TRACE_PREDICATED)
+        return flags | (condition_holds((rec->flags >> RECORD_CC_SHIFT) & 0xf, rec->target) ? TRACE_TAKEN : 0);
+    if (flags & TRACE_REP)
+        return flags | ((rec->target != 0) ? TRACE_TAKEN : 0);
+    if (rec->taken)
+        flags |= TRACE_TAKEN;
+
+    if (flags & TRACE_COND)
+        td->setcbcount++;
+    else
+        td->ubcount++;
+    if (flags & TRACE_CALL)
+        td->callcount++;
+    if (flags & TRACE_RET)
+        td->retcount++;
+
+    // Returns are indirect too, but are counted on their own
+    if ((flags & TRACE_COND) && rec->taken)
+        td->takencount++;
+    else if (!(flags & (TRACE_DIRECT | TRACE_COND | TRACE_RET)) && (flags & TRACE_CALL))
+        td->indirectcallcount++;
+    else if (!(flags & (TRACE_DIRECT | TRACE_COND | TRACE_RET)))
+        td->indirectcount++;
+    count_static(td, rec, flags);
+
+    return flags;
+}
+
+#ifdef ONLINE_PREDICTOR
+// Runs `numRecords` branches through the predictor, like the simulator's loop
+VOID write_records(THREAD_DATA *td, const BRANCH_RECORD *rec, UINT64 numRecords)
+{
+    PIN_MutexLock(&predictorLock);
+    for (UINT64 i = 0; i < numRecords; i++, rec++)
+    {
+        UINT64 insts;
+        UINT32 flags = count_record(td, rec, &insts);
+        UINT32 outcome = (flags & TRACE_TAKEN) ? TAKEN : NOTTAKEN;
+        UINT32 direct = (flags & TRACE_DIRECT) ? 1 : 0;
+        td->predInsts += insts;
+        if (flags & TRACE_NOT_BRANCH)
+            continue;
+        if (KnobContext)
+        {
+            callFunction = td->contextFunction;
+            callContext = td->contextHash;
+            callDepth = td->callStack.size();
+            track_context(td, flags, rec);
+        }
+
+        if (flags & TRACE_COND)
+        {
+            td->predBranches++;
+            if (make_prediction(rec->pc, rec->target, direct) != outcome)
+                td->predMispredictions++;
+            if (KnobInterval > 0 && td->predBranches - td->intervalBranches == KnobInterval)
+                write_interval(td);
+        }
+        train_predictor(rec->pc, rec->target, outcome, (flags & TRACE_COND) ? 1 : 0,
+                        (flags & TRACE_CALL) ? 1 : 0, (flags & TRACE_RET) ? 1 : 0, direct);
+    }
+    PIN_MutexUnlock(&predictorLock);
+}
+#else
+// Encodes one record of the trace at `p`, returns its end
+static char *encode_record(char *p, UINT64 pc, UINT64 target, UINT32 flags, UINT32 id, UINT64 insts, UINT32 length)
+{
+    if (KnobTextOutput)
+    {
+        p += sprintf(p, "0x%llx\t0x%llx\t%d\t%d\t%d\t%d\t%d",
+                     (unsigned long long)pc,          // PC
+                     (unsigned long long)target,      // Target
+                     (flags & TRACE_TAKEN) ? 1 : 0,   // T-N
+                     (flags & TRACE_COND) ? 1 : 0,    // Conditional
+                     (flags & TRACE_CALL) ? 1 : 0,    // Call
+                     (flags & TRACE_RET) ? 1 : 0,     // Ret
+                     (flags & TRACE_DIRECT) ? 1 : 0); // Direct
+        if (flags & TRACE_NOT_BRANCH)
+            p += sprintf(p, "\t%d", (flags & TRACE_NOT_BRANCH) >> TRACE_KIND_SHIFT); // Kind
+        if (flags & TRACE_CONTEXT)
+            p += sprintf(p, "\t%d", flags >> TRACE_DEPTH_SHIFT); // Depth
+        *p++ = '\n';
+    }
+    else if (compactRecords)
+    {
+        trace_compact_record *out_rec = (trace_compact_record *)p;
+        out_rec->branch = (id << 1) | ((flags & TRACE_TAKEN) ? 1 : 0);
+        out_rec->insts = (insts < 0xffff) ? insts : 0xffff;
+        out_rec->reserved = 0;
+        p += sizeof(trace_compact_record);
+        if (flags & TRACE_CONTEXT)
+        {
+            memcpy(p, &pc, sizeof(pc));
+            p += sizeof(pc);
+        }
+        if (TRACE_HAS_TARGET(flags))
+        {
+            memcpy(p, &target, sizeof(target));
+            p += sizeof(target);
+        }
+    }
+    else
+    {
+        trace_record *out_rec = (trace_record *)p;
+        out_rec->pc = pc;
+        out_rec->target = target;
+        out_rec->flags = flags;
+        out_rec->insts = (insts < 0xffff) ? insts : 0xffff;
+        out_rec->length = length;
+        out_rec->reserved = 0;
+        p += sizeof(trace_record);
+    }
+    return p;
+}
+
+// Encodes `numRecords` branches into one block for the writer thread
+VOID write_records(THREAD_DATA *td, const BRANCH_RECORD *rec, UINT64 numRecords)
+{
+    OUTPUT_BLOCK *block = acquire_block(td->writer);
+    block->file = td->outFile;
+    char *out = &block->data[0];
+    char *p = out;
+
+    td->loads.clear();
+
+    // Where the block starts, for -index
+    block->indexFile = td->indexFile;
+    block->entry.branch = td->setBranches;
+    block->entry.insts = td->lastIcount - td->setStart;
+    block->entry.data = td->setBytes;
+
+    for (UINT64 i = 0; i < numRecords; i++, rec++)
+    {
+        if (rec->flags & RECORD_LOAD)
+        {
+            trace_load_record load = {td->setBranches, rec->pc, rec->target, rec->icount,
+                                      rec->flags >> RECORD_LENGTH_SHIFT, 0};
+            td->loads.push_back(load);
+            continue;
+        }
+
+        UINT64 insts;
+        UINT32 flags = count_record(td, rec, &insts);
+        UINT64 target = (flags & TRACE_PREDICATED) ? 0 : rec->target;
+
+        if (KnobContext && (flags & TRACE_COND) && td->contextChanged)
+        {
+            UINT32 depth = (td->callStack.size() < 0xffff) ? td->callStack.size() : 0xffff;
+            if (compactRecords)
+                p = encode_record(p, td->contextFunction, td->contextHash, TRACE_CONTEXT, TRACE_CONTEXT_ID, depth, 0);
+            else
+                p = encode_record(p, td->contextFunction, td->contextHash,
+                                  TRACE_CONTEXT | (depth << TRACE_DEPTH_SHIFT), 0, 0, 0);
+            td->contextChanged = FALSE;
+        }
+        if (!(flags & TRACE_NOT_BRANCH))
+            td->setBranches++;
+        if (KnobContext)
+            track_context(td, flags, rec);
 
-static UINT64 CBCOUNT_LIMIT = 10000000;
-static UINT64 prev_cbcount = -1;
+        p = encode_record(p, rec->pc, target, flags, rec->id, insts, rec->flags >> RECORD_LENGTH_SHIFT);
+    }
 
-KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool", "o", "branches", "specifies the output file name prefix.");
+    block->size = p - out;
+    td->setBytes += block->size;
+    if (block->size == 0)
+        block->indexFile = NULL;
+    submit_block(block);
+
+    // After the trace block, so a thread never holds two blocks at once
+    if (!td->loads.empty())
+    {
+        block = acquire_block(td->writer);
+        block->file = td->loadFile;
+        block->size = td->loads.size() * sizeof(trace_load_record);
+        memcpy(&block->data[0], &td->loads[0], block->size);
+        submit_block(block);
+    }
+}
+#endif
+
+// Opens and closes the sets whose branches have all been written out
+VOID apply_set_events(THREAD_DATA *td)
+{
+    while (!td->setEvents.empty() && td->setEvents.front().records == td->flushedcount)
+    {
+        const SET_EVENT &ev = td->setEvents.front();
+        if (ev.open)
+        {
+            td->fileCounter = ev.set;
+            td->lastIcount = ev.instructions;
+            td->setStart = ev.instructions;
+            td->regionName = ev.name;
+            open_files(td);
+        }
+        else if (td->open)
+        {
+            close_files(td, ev.instructions, ev.warmup);
+        }
+        td->setEvents.pop_front();
+    }
+}
+
+// Writes out the branches of the buffer, opening and closing the sets on the way
+VOID flush_records(THREAD_DATA *td, const BRANCH_RECORD *rec, UINT64 numElements)
+{
+    // The parent process writes these
+    UINT64 discard = (td->discardcount < numElements) ? td->discardcount : numElements;
+    rec += discard;
+    numElements -= discard;
+    td->flushedcount += discard;
+    td->discardcount -= discard;
 
-KNOB<string> KnobHowManySet(KNOB_MODE_WRITEONCE, "pintool", "b", "1", "Specifies how many set should be created.");
+    apply_set_events(td);
+    while (numElements > 0)
+    {
+        UINT64 n = numElements;
+        if (!td->setEvents.empty() && td->setEvents.front().records - td->flushedcount < n)
+            n = td->setEvents.front().records - td->flushedcount;
 
-KNOB<string> KnobHowManyBranch(KNOB_MODE_WRITEONCE, "pintool", "m", "-1", "Specifies how many instructions should be probed. -1 for probing whole program.");
+        write_records(td, rec, n);
+        rec += n;
+        numElements -= n;
+        td->flushedcount += n;
 
-KNOB<string> KnobOffset(KNOB_MODE_WRITEONCE, "pintool", "f", "20000000", "Starts saving instructions after seeing the first `f` instruction.");
-// KNOB<string> KnobOffset(KNOB_MODE_WRITEONCE, "pintool", "f", "0", "Starts saving instructions after seeing the first `f` instruction.");
+        apply_set_events(td);
+    }
+}
 
-VOID write_on_axu()
+// Called on the thread that owns the buffer, also when the thread exits
+VOID *BufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf, UINT64 numElements, VOID *v)
 {
-    axuFile << "!!! Number of Instructions = " << (icount - offset_inst - ((fileCounter - 1) * howManyBranch) + 1) << endl;
-    axuFile << "!!! Number of Unconditional branches = " << ubcount << endl;
-    axuFile << "!!! Number of Conditional branches = " << cbcount << endl;
-    axuFile << "!!! Number of Call branches = " << callcount << endl;
-    axuFile << "!!! Number of Ret branches = " << retcount << endl;
+    THREAD_DATA *td = get_thread_data(tid);
 
-    axuFile.close();
+    // After a detach the branches have already been written by ThreadDetach
+    if (!td->closed)
+        flush_records(td, (const BRANCH_RECORD *)buf, numElements);
+
+    return buf;
 }
 
-VOID Fini(INT32 code, VOID *v)
+/************
+ *
+ * Time window
+ *
+ * With -window_ms the trace ends after a span of wall-clock time instead of
+ * (or before) -b regions, which suits a service Pin has attached to with
+ * -pid. A Pin internal thread waits out the window and then makes every
+ * recording thread take its BranchEvent at its next conditional branch. The
+ * first one to get there ends the trace like the last of -b regions.
+ */
+
+static BOOL windowExpired = FALSE;
+static BOOL timerRunning = FALSE;
+static PIN_THREAD_UID timerUid;
+static PIN_SEMAPHORE windowStarted; // set by the first region
+static PIN_SEMAPHORE timerQuit;     // set when the tool ends first
+
+static VOID WindowTimer(VOID *arg)
 {
-    // Write to a file since cout and cerr maybe closed by the application
-    cout << "Logging data..." << endl;
-    write_on_axu();
-    OutFile.close();
+    PIN_SemaphoreWait(&windowStarted);
+    if (PIN_SemaphoreTimedWait(&timerQuit, KnobWindowMs.Value()))
+        return;
+
+    cout << "The " << KnobWindowMs.Value() << " ms window is over" << endl;
+    PIN_MutexLock(&threadLock);
+    windowExpired = TRUE;
+    for (UINT32 i = 0; i < threads.size(); i++)
+    {
+        if (threads[i]->record)
+            threads[i]->nextBranchEvent = 0;
+    }
+    PIN_MutexUnlock(&threadLock);
 }
 
-VOID reset_var()
+static VOID start_window_timer()
 {
-    cbcount = 0;
-    ubcount = 0;
-    callcount = 0;
-    retcount = 0;
-    first_inst_count_after_offset = 0;
+    PIN_SemaphoreInit(&windowStarted);
+    PIN_SemaphoreInit(&timerQuit);
+    timerRunning = PIN_SpawnInternalThread(WindowTimer, 0, 0, &timerUid) != INVALID_THREADID;
+    if (!timerRunning)
+        cerr << "Warning: could not spawn the window timer, -window_ms is ignored" << endl;
 }
 
-UINT32 file_init()
+static VOID stop_window_timer()
 {
-    cout << "Writing " << fileCounter - 1 << endl;
+    if (!timerRunning)
+        return;
+    timerRunning = FALSE;
+    PIN_SemaphoreSet(&timerQuit);
+    PIN_SemaphoreSet(&windowStarted);
+    PIN_WaitForThreadTermination(timerUid, PIN_INFINITE_TIMEOUT, NULL);
+}
 
-    write_on_axu();
+/************
+ *
+ * Progress
+ *
+ * Progress is reported by a Pin internal thread, every -progress_ms, so the
+ * instrumentation path only counts. The thread reads cbcount and record of
+ * the recording threads without stopping them, so the owning thread stores
+ * both with relaxed atomic stores and the progress thread loads them with
+ * relaxed atomic loads: a count may be a branch or so behind, which does not
+ * matter for a progress line. threadLock only guards the threads vector.
+ */
 
-    OutFile.close();
-    filePrefix.str("");
-    filePrefix.clear();
-    filePrefix << KnobOutputFile.Value() << "_" << fileCounter << ".out";
-    OutFile.open(filePrefix.str().c_str());
-    OutFile.setf(ios::showbase);
+static BOOL progressRunning = FALSE;
+static PIN_THREAD_UID progressUid;
+static PIN_SEMAPHORE progressQuit;
 
-    filePrefix.str("");
-    filePrefix.clear();
-    filePrefix << axuliryFileName << "_" << fileCounter << ".out";
-    axuFile.open(filePrefix.str().c_str());
-    axuFile.setf(ios::showbase);
+static VOID ProgressThread(VOID *arg)
+{
+    UINT32 period = KnobProgressMs.Value();
+    while (!PIN_SemaphoreTimedWait(&progressQuit, period))
+    {
+        PIN_MutexLock(&threadLock);
+        for (UINT32 i = 0; i < threads.size(); i++)
+        {
+            THREAD_DATA *td = threads[i];
+            if (!__atomic_load_n(&td->record, __ATOMIC_RELAXED))
+                continue;
+            // cbcount starts again from 0 in every region
+            UINT64 cbcount = __atomic_load_n(&td->cbcount, __ATOMIC_RELAXED);
+            UINT64 last = (cbcount >= td->progressCount) ? td->progressCount : 0;
+            UINT64 rate = (cbcount - last) * 1000 / period;
+            td->progressCount = cbcount;
+            cout << "Thread " << td->tid << ": " << cbcount << " conditional branches, "
+                 << rate << "/s" << endl;
+        }
+        PIN_MutexUnlock(&threadLock);
+    }
+}
 
-    reset_var();
+static VOID start_progress()
+{
+    PIN_SemaphoreInit(&progressQuit);
+    progressRunning = PIN_SpawnInternalThread(ProgressThread, 0, 0, &progressUid) != INVALID_THREADID;
+    if (!progressRunning)
+        cerr << "Warning: could not spawn the progress thread" << endl;
+}
 
-    return 0;
+static VOID stop_progress()
+{
+    if (!progressRunning)
+        return;
+    progressRunning = FALSE;
+    PIN_SemaphoreSet(&progressQuit);
+    PIN_WaitForThreadTermination(progressUid, PIN_INFINITE_TIMEOUT, NULL);
+}
+
+// Turns the branch instrumentation on when the first thread enters a
+// region and off when the last one leaves
+VOID update_recording(INT32 delta)
+{
+    PIN_MutexLock(&threadLock);
+    recordingThreads += delta;
+    bool changed = (recordingThreads > 0) != record;
+    record = recordingThreads > 0;
+    PIN_MutexUnlock(&threadLock);
+
+    // Re-instruments the code translated so far with or without branches
+    if (changed)
+        PIN_RemoveInstrumentation();
+}
+
+// Set of a new region: the region number of -regions:in, otherwise the
+// regions are numbered in the order the thread enters them. A region of
+// -regions:in also gets its name, with its lengths and weight
+UINT64 region_set(THREAD_DATA *td, string *name)
+{
+    REGION_INFO_CALLBACK regionInfo = control.GetRegionInfoCallback();
+    if (control.IregionsActive() && regionInfo != NULL)
+    {
+        td->regions++;
+        CONTROL_REGION_INFO info = regionInfo(td->tid, control.GetRegionInfoParam());
+        *name = info.regionName;
+        return info.regionId;
+    }
+    return td->regions++;
+}
+
+VOID start_region(THREAD_DATA *td, UINT64 icount)
+{
+    SET_EVENT ev = {td->reccount, TRUE, 0, icount, 0};
+    ev.set = region_set(td, &ev.name);
+    td->setEvents.push_back(ev);
+
+    cout << "Thread " << td->tid << ": writing " << ev.set << endl;
+    if (timerRunning)
+        PIN_SemaphoreSet(&windowStarted);
+
+    td->startInstructions = icount;
+    td->startRecords = td->reccount;
+    td->warmupRecords = 0;
+    __atomic_store_n(&td->cbcount, 0, __ATOMIC_RELAXED);
+    td->nextBranchEvent = 0;
+    __atomic_store_n(&td->record, 1, __ATOMIC_RELAXED);
+
+    update_recording(1);
+}
+
+// Queues the close of the set, the branches of the region may still be in
+// the trace buffer
+VOID end_set(THREAD_DATA *td, UINT64 icount)
+{
+    SET_EVENT ev = {td->reccount, FALSE, 0, icount - td->startInstructions, td->warmupRecords};
+    td->setEvents.push_back(ev);
+    __atomic_store_n(&td->record, 0, __ATOMIC_RELAXED);
+    td->nextBranchEvent = (UINT64)-1;
 }
 
-// This function is called before every instruction is executed
-VOID docount()
+VOID stop_region(THREAD_DATA *td, UINT64 icount)
 {
-    // cerr<< "I:" << icount << "V:" << (howManyBranch+ offset_inst - 1) << (!((icount) % (howManyBranch+ offset_inst - 1))? "Tr":"Fa") << endl;
-    if (howManyBranch > 0)
+    if (!td->record)
+        return;
+
+    end_set(td, icount);
+    update_recording(-1);
+
+    PIN_MutexLock(&threadLock);
+    UINT64 traced = ++tracedRegions;
+    // Only one thread ends the trace. Threads still inside a region close
+    // their sets on the detach or exit
+    BOOL last = ((howManySet > 0 && traced == howManySet) || windowExpired) && !detaching;
+    if (last)
+        detaching = TRUE;
+    PIN_MutexUnlock(&threadLock);
+
+    if (last)
     {
-        if (!((icount) % ((howManyBranch * (fileCounter + 1)) + offset_inst - 1)) && icount > 0)
+        if (KnobDetach)
         {
-            fileCounter++;
-            if (fileCounter > howManySet - 1)
-            {
-                cout << "Exiting because of user conditions" << endl;
-                Fini(0, 0);
-                exit(0);
-            }
-            else
-            {
-                file_init();
-            }
+            cout << "Detaching after the last region" << endl;
+            // Pin detaches once all threads reach a safe point; ThreadDetach
+            // and Detach write out what is left in the buffers
+            PIN_Detach();
+        }
+        else
+        {
+            cout << "Exiting because of user conditions" << endl;
+            // Runs the thread fini (flushing the trace buffers) and Fini callbacks
+            PIN_ExitApplication(0);
         }
     }
+}
+
+// Closes the last set of a thread, once its trace buffer has been flushed.
+// Without the thread's context the instructions after its last branch are
+// not counted
+VOID close_thread(THREAD_DATA *td, UINT64 icount)
+{
+    if (td->closed)
+        return;
+    td->closed = TRUE;
+
+    if (td->record)
+        end_set(td, icount);
+    apply_set_events(td);
+}
+
+// Controller events are applied to the thread that triggers them, broadcast
+// events also to the threads started afterwards. A region is recorded from
+// its warmup or prolog, when there is one, to EVENT_STOP; the epilog is not
+// recorded
+VOID ControlHandler(EVENT_TYPE ev, VOID *v, CONTEXT *ctxt, VOID *ip, THREADID tid, BOOL bcast)
+{
+    THREAD_DATA *td = get_thread_data(tid);
+    UINT64 icount = PIN_GetContextReg(ctxt, icountReg);
+
+    if (bcast && (ev == EVENT_START || ev == EVENT_STOP))
+        allThreads = (ev == EVENT_START);
+
+    switch (ev)
+    {
+    case EVENT_WARMUP_START:
+    case EVENT_PROLOG_START:
+        if (!td->record && !detaching)
+            start_region(td, icount);
+        break;
+
+    case EVENT_START:
+        if (detaching)
+            break;
+        if (!td->record)
+            start_region(td, icount);
+        td->warmupRecords = td->reccount - td->startRecords;
+        break;
+
+    case EVENT_STOP:
+        stop_region(td, icount);
+        break;
+
+    default:
+        break;
+    }
+}
+
+VOID Fini(INT32 code, VOID *v)
+{
+    // Write to a file since cout and cerr maybe closed by the application
+    cout << "Logging data..." << endl;
+
+    for (UINT32 i = 0; i < threads.size(); i++)
+    {
+        close_thread(threads[i], threads[i]->lastIcount);
+    }
+    stop_writer();
+    finish_shm();
+    write_dictionary();
+
+    for (UINT32 i = 0; i < threads.size(); i++)
+    {
+        delete threads[i];
+    }
+    threads.clear();
+}
+
+// Internal threads have to end before Pin terminates the application. The
+// branches still in the trace buffers are written synchronously after this
+VOID PrepareForFini(VOID *v)
+{
+    stop_window_timer();
+    stop_progress();
+    stop_writer();
+}
+
+// Pin does not flush the trace buffers when it detaches, so the branches
+// recorded since the last BufferFull are written out from the buffer here
+VOID write_pending(THREAD_DATA *td)
+{
+    if (td->closed)
+        return;
+
+    flush_records(td, (const BRANCH_RECORD *)td->bufferBase, td->reccount - td->flushedcount);
+    close_thread(td, td->lastIcount);
+}
+
+// Called on the thread, in its native context, before Pin detaches from it
+VOID ThreadDetach(THREADID tid, const CONTEXT *ctxt, VOID *v)
+{
+    write_pending(get_thread_data(tid));
+}
+
+// Called once every thread has been detached
+VOID Detach(VOID *v)
+{
+    cout << "Logging data..." << endl;
+    stop_window_timer();
+    stop_progress();
+
+    for (UINT32 i = 0; i < threads.size(); i++)
+    {
+        write_pending(threads[i]);
+    }
+    stop_writer();
+    finish_shm();
+    write_dictionary();
+}
+
+// Called in a fork child, on its only thread. The child goes on in files
+// of its own, the parent writes what was recorded before the fork
+VOID ForkChild(THREADID tid, const CONTEXT *ctxt, VOID *v)
+{
+    string parent = KnobOutputFile.Value() + processSuffix;
+    processSuffix = "_p" + decstr(PIN_GetPid());
+    append_manifest("fork", parent, KnobOutputFile.Value() + processSuffix, FALSE);
+
+    // The locks may be held by threads that only exist in the parent
+    PIN_MutexInit(&threadLock);
+    reset_writer();
+    tracedRegions = 0;
+    timerRunning = FALSE; // only the parent has the timer and progress threads
+    progressRunning = FALSE;
+
+    THREAD_DATA *td = get_thread_data(tid);
+    threads.clear();
+    threads.push_back(td);
+    recordingThreads = td->record ? 1 : 0;
+
+    // The set the thread is in, once the pending events are dropped
+    UINT64 set = td->fileCounter;
+    for (UINT32 i = 0; i < td->setEvents.size(); i++)
+    {
+        if (td->setEvents[i].open)
+            set = td->setEvents[i].set;
+    }
+
+    // Destroying the parent's streams would flush their buffered output
+    // into the files both processes share, so they are only dropped or replaced
+    td->outFile = NULL;
+    new (&td->axuFile) ofstream();
+    td->loadFile = NULL;
+    td->indexFile = NULL;
+#ifdef ONLINE_PREDICTOR
+    new (&td->intervalFile) ofstream();
+#endif
+    td->open = FALSE;
+    td->setEvents.clear();
+    td->discardcount = td->reccount - td->flushedcount;
 
-    icount++;
+    if (td->record)
+    {
+        UINT64 icount = PIN_GetContextReg(ctxt, icountReg);
+        SET_EVENT ev = {td->reccount, TRUE, set, icount, 0};
+        td->setEvents.push_back(ev);
+        td->startInstructions = icount;
+        td->startRecords = td->reccount;
+        td->warmupRecords = 0;
+    }
+}
 
-    if (cbcount != prev_cbcount && cbcount % 10000 == 0)
-        cout << icount << " "<< cbcount << endl;
-    prev_cbcount = cbcount;
+// Called before the program execs, with Pin's -follow_execv. The image is
+// replaced without Fini, so everything is written out as on a detach
+BOOL FollowChild(CHILD_PROCESS child, VOID *v)
+{
+    string prefix = KnobOutputFile.Value() + processSuffix;
+    string base = KnobOutputFile.Value() + "_p" + decstr(PIN_GetPid());
+    UINT32 generation = 1;
+    if (prefix != base)
+        generation = strtoul(prefix.c_str() + base.size() + 2, NULL, 10) + 1;
+    append_manifest("exec", prefix, base + "_x" + decstr(generation), FALSE);
 
-    if (cbcount >= CBCOUNT_LIMIT)
+    cout << "Logging data before exec..." << endl;
+    for (UINT32 i = 0; i < threads.size(); i++)
     {
-        fileCounter++;
-        cout << "Exiting because of CBCOUNT_LIMIT" << endl;
-        Fini(0, 0);
-        exit(0);
+        write_pending(threads[i]);
     }
+    stop_writer();
+    finish_shm();
+    write_dictionary();
+
+    return TRUE;
+}
+
+// Inlined by Pin, only inserted while a thread is inside a region or with
+// -sample_period. The count is kept in icountReg and counts the whole block up front, so a
+// branch, which ends its block, sees every instruction up to itself
+static ADDRINT CountBlock(ADDRINT icount, UINT32 numInsts)
+{
+    return icount + numInsts;
+}
+
+// Counts the branch if the thread is recording, inlined by Pin. The branch
+// is only written into the buffer when this returns 1. Only this thread
+// writes cbcount; the relaxed store is a plain move, for ProgressThread
+static ADDRINT RecordBranch(THREAD_DATA *td, UINT32 conditional)
+{
+    td->reccount += td->record;
+    __atomic_store_n(&td->cbcount, td->cbcount + (conditional & td->record), __ATOMIC_RELAXED);
+    return td->record;
+}
+
+// Inlined by Pin, with -loads
+static ADDRINT Recording(THREAD_DATA *td)
+{
+    return td->record;
+}
+
+// With -load_values, for a load that is recorded
+static ADDRINT ReadValue(ADDRINT addr, UINT32 size)
+{
+    ADDRINT value = 0;
+    PIN_SafeCopy(&value, (VOID *)addr, (size < sizeof(value)) ? size : sizeof(value));
+    return value;
+}
+
+// Like RecordBranch for a REP instruction, which Pin calls on every iteration
+static ADDRINT RecordRep(THREAD_DATA *td, BOOL first)
+{
+    ADDRINT record = td->record & first;
+    td->reccount += record;
+    return record;
+}
+
+// Inlined by Pin, with -sample_period
+static ADDRINT WindowDue(THREAD_DATA *td, ADDRINT icount)
+{
+    return icount >= td->nextWindow;
+}
 
-    if (icount >= offset_inst && fileCounter == 0)
+// Starts the -sample_period window the thread has reached. It ends like
+// any other region, at -max_cond_branches
+static VOID WindowStart(THREAD_DATA *td, ADDRINT icount)
+{
+    td->nextWindow = icount - (icount % samplePeriod) + samplePeriod;
+    if (!td->record && !detaching)
+        start_region(td, icount);
+}
+
+// Inlined by Pin
+static ADDRINT BranchDue(THREAD_DATA *td)
+{
+    return td->cbcount >= td->nextBranchEvent;
+}
+
+// Called at the start of a region, at -max_cond_branches and when the
+// -window_ms window is over
+static VOID BranchEvent(THREAD_DATA *td, ADDRINT icount)
+{
+    if (windowExpired)
     {
-        // cout << "Here!" << endl;
-        first_inst_count_after_offset++; // Although here is going to be increased by one, it will be set to 1 whenever it reaches to fist branch;
-        record = true;
+        stop_region(td, icount);
+        return;
     }
-    else if (fileCounter > 0)
+    if (maxCondBranches > 0 && td->cbcount >= maxCondBranches)
     {
-        first_inst_count_after_offset++;
+        cout << "Thread " << td->tid << ": region ended because of -max_cond_branches" << endl;
+        stop_region(td, icount);
+        return;
     }
+
+    td->nextBranchEvent = (maxCondBranches > 0) ? maxCondBranches : (UINT64)-1;
 }
 
 VOID ImageLoad(IMG img, VOID *v)
@@ -223,302 +1879,328 @@ VOID ImageLoad(IMG img, VOID *v)
     }
 }
 
-/************
- *
- * JMP segment
- *
- */
+// The condition code of a CMOVcc or SETcc, -1 for other instructions
+static INT32 predicate_code(INS ins)
+{
+    switch (INS_Opcode(ins))
+    {
+    case XED_ICLASS_CMOVO: case XED_ICLASS_SETO: return 0x0;
+    case XED_ICLASS_CMOVNO: case XED_ICLASS_SETNO: return 0x1;
+    case XED_ICLASS_CMOVB: case XED_ICLASS_SETB: return 0x2;
+    case XED_ICLASS_CMOVNB: case XED_ICLASS_SETNB: return 0x3;
+    case XED_ICLASS_CMOVZ: case XED_ICLASS_SETZ: return 0x4;
+    case XED_ICLASS_CMOVNZ: case XED_ICLASS_SETNZ: return 0x5;
+    case XED_ICLASS_CMOVBE: case XED_ICLASS_SETBE: return 0x6;
+    case XED_ICLASS_CMOVNBE: case XED_ICLASS_SETNBE: return 0x7;
+    case XED_ICLASS_CMOVS: case XED_ICLASS_SETS: return 0x8;
+    case XED_ICLASS_CMOVNS: case XED_ICLASS_SETNS: return 0x9;
+    case XED_ICLASS_CMOVP: case XED_ICLASS_SETP: return 0xa;
+    case XED_ICLASS_CMOVNP: case XED_ICLASS_SETNP: return 0xb;
+    case XED_ICLASS_CMOVL: case XED_ICLASS_SETL: return 0xc;
+    case XED_ICLASS_CMOVNL: case XED_ICLASS_SETNL: return 0xd;
+    case XED_ICLASS_CMOVLE: case XED_ICLASS_SETLE: return 0xe;
+    case XED_ICLASS_CMOVNLE: case XED_ICLASS_SETNLE: return 0xf;
+    default: return -1;
+    }
+}
 
-static VOID UnconDirectJMP(ADDRINT ip, ADDRINT target, BOOL taken)
-{
-
-    OutFile << std::hex
-            << (ip & 0xffffffff)             // PC
-            << "\t" << (target & 0xffffffff) // Target
-            << (taken ? "\t1" : "\t0")       // T-N
-            << "\t0"                         // Unconditional
-            << "\t0"                         // Not Call
-            << "\t0"                         // Not Ret
-            << "\t1"                         // Direct
-            << "\n"
-            << flush;
-    ubcount++;
-}
-
-static VOID UnconUnDirectJMP(ADDRINT ip, ADDRINT target, BOOL taken)
-{
-    OutFile << std::hex
-            << (ip & 0xffffffff)             // PC
-            << "\t" << (target & 0xffffffff) // Target
-            << (taken ? "\t1" : "\t0")       // T-N
-            << "\t0"                         // Unconditional
-            << "\t0"                         // Not Call
-            << "\t0"                         // Not Ret
-            << "\t0"                         // Not Direct
-            << "\n"
-            << flush;
-    ubcount++;
-}
-
-static VOID ConDirectJMP(ADDRINT ip, ADDRINT target, BOOL taken)
-{
-    OutFile << std::hex
-            << (ip & 0xffffffff)             // PC
-            << "\t" << (target & 0xffffffff) // Target
-            << (taken ? "\t1" : "\t0")       // T-N
-            << "\t1"                         // Conditional
-            << "\t0"                         // Not Call
-            << "\t0"                         // Not Ret
-            << "\t1"                         // Direct
-            << "\n"
-            << flush;
-    cbcount++;
-}
-static VOID ConUnDirectJMP(ADDRINT ip, ADDRINT target, BOOL taken)
-{
-    OutFile << std::hex
-            << (ip & 0xffffffff)             // PC
-            << "\t" << (target & 0xffffffff) // Target
-            << (taken ? "\t1" : "\t0")       // T-N
-            << "\t1"                         // Conditional
-            << "\t0"                         // Not Call
-            << "\t0"                         // Not Ret
-            << "\t0"                         // Not Direct
-            << "\n"
-            << flush;
-    cbcount++;
-}
-//****************************************************************
+// Records a CMOVcc/SETcc with the flags register it tests, whether the
+// condition holds is only evaluated when the record is written out
+static VOID InstrumentPredicated(INS ins, UINT32 cc)
+{
+    UINT32 flags = TRACE_PREDICATED;
+    INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordBranch,
+                     IARG_REG_VALUE, tlsReg,
+                     IARG_UINT32, 0,
+                     IARG_END);
+    UINT32 recordFlags = flags | (cc << RECORD_CC_SHIFT) | (INS_Size(ins) << RECORD_LENGTH_SHIFT);
+    UINT32 id = KnobDictionary ? branch_id(ins, flags) : 0;
+    INS_InsertFillBufferThen(ins, IPOINT_BEFORE, bufId,
+                             IARG_INST_PTR, offsetof(BRANCH_RECORD, pc),
+                             IARG_REG_VALUE, REG_GFLAGS, offsetof(BRANCH_RECORD, target),
+                             IARG_UINT32, recordFlags, offsetof(BRANCH_RECORD, flags),
+                             IARG_UINT32, id, offsetof(BRANCH_RECORD, id),
+                             IARG_REG_VALUE, icountReg, offsetof(BRANCH_RECORD, icount),
+                             IARG_END);
+}
 
-/************
- *
- * Ret segment
- *
- */
+// Records a REP string instruction once, before its first iteration, with
+// the count register
+static VOID InstrumentRep(INS ins)
+{
+    UINT32 flags = TRACE_REP;
+    INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordRep,
+                     IARG_REG_VALUE, tlsReg,
+                     IARG_FIRST_REP_ITERATION,
+                     IARG_END);
+    UINT32 recordFlags = flags | (INS_Size(ins) << RECORD_LENGTH_SHIFT);
+    UINT32 id = KnobDictionary ? branch_id(ins, flags) : 0;
+    INS_InsertFillBufferThen(ins, IPOINT_BEFORE, bufId,
+                             IARG_INST_PTR, offsetof(BRANCH_RECORD, pc),
+                             IARG_REG_VALUE, INS_RepCountRegister(ins), offsetof(BRANCH_RECORD, target),
+                             IARG_UINT32, recordFlags, offsetof(BRANCH_RECORD, flags),
+                             IARG_UINT32, id, offsetof(BRANCH_RECORD, id),
+                             IARG_REG_VALUE, icountReg, offsetof(BRANCH_RECORD, icount),
+                             IARG_END);
+}
+
+// Records the loads of the block that the condition of its conditional
+// branch depends on, found by walking the block backwards from the branch.
+// At most -loads of them, the ones closest to the branch
+static VOID InstrumentBranchLoads(BBL bbl)
+{
+    INS branch = BBL_InsTail(bbl);
+    if (!INS_IsValidForIpointTakenBranch(branch) || !INS_HasFallThrough(branch))
+        return;
+
+    // Registers the condition depends on, the flags for most branches
+    set<REG> needed;
+    for (UINT32 i = 0; i < INS_MaxNumRRegs(branch); i++)
+        needed.insert(REG_FullRegName(INS_RegR(branch, i)));
+    needed.erase(REG_INST_PTR);
+
+    UINT32 found = 0;
+    for (INS ins = INS_Prev(branch); INS_Valid(ins) && found < loadSlice && !needed.empty(); ins = INS_Prev(ins))
+    {
+        BOOL feeds = FALSE;
+        for (UINT32 i = 0; i < INS_MaxNumWRegs(ins); i++)
+        {
+            REG reg = INS_RegW(ins, i);
+            if (needed.count(REG_FullRegName(reg)) == 0)
+                continue;
+            feeds = TRUE;
+            // A partial write keeps the rest of the older value
+            if (reg == REG_FullRegName(reg) || REG_is_gr32(reg))
+                needed.erase(REG_FullRegName(reg));
+        }
+        if (!feeds)
+            continue;
+        for (UINT32 i = 0; i < INS_MaxNumRRegs(ins); i++)
+            needed.insert(REG_FullRegName(INS_RegR(ins, i)));
+        needed.erase(REG_INST_PTR);
+        if (!INS_IsMemoryRead(ins) || !INS_IsStandardMemop(ins))
+            continue;
+
+        found++;
+        // Of the operand IARG_MEMORYREAD_EA is, the first one read
+        UINT32 size = 0;
+        for (UINT32 op = 0; op < INS_MemoryOperandCount(ins) && size == 0; op++)
+        {
+            if (INS_MemoryOperandIsRead(ins, op))
+                size = INS_MemoryOperandSize(ins, op);
+        }
+        UINT32 recordFlags = RECORD_LOAD | (size << RECORD_LENGTH_SHIFT);
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordBranch,
+                         IARG_REG_VALUE, tlsReg,
+                         IARG_UINT32, 0,
+                         IARG_END);
+        if (KnobLoadValues)
+        {
+            INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)ReadValue,
+                               IARG_MEMORYREAD_EA, IARG_MEMORYREAD_SIZE,
+                               IARG_RETURN_REGS, valueReg, IARG_END);
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)Recording, IARG_REG_VALUE, tlsReg, IARG_END);
+            INS_InsertFillBufferThen(ins, IPOINT_BEFORE, bufId,
+                                     IARG_INST_PTR, offsetof(BRANCH_RECORD, pc),
+                                     IARG_MEMORYREAD_EA, offsetof(BRANCH_RECORD, target),
+                                     IARG_UINT32, recordFlags, offsetof(BRANCH_RECORD, flags),
+                                     IARG_REG_VALUE, valueReg, offsetof(BRANCH_RECORD, icount),
+                                     IARG_END);
+        }
+        else
+        {
+            INS_InsertFillBufferThen(ins, IPOINT_BEFORE, bufId,
+                                     IARG_INST_PTR, offsetof(BRANCH_RECORD, pc),
+                                     IARG_MEMORYREAD_EA, offsetof(BRANCH_RECORD, target),
+                                     IARG_UINT32, recordFlags, offsetof(BRANCH_RECORD, flags),
+                                     IARG_UINT64, (UINT64)0, offsetof(BRANCH_RECORD, icount),
+                                     IARG_END);
+        }
+    }
+}
 
-static VOID UnconDirectRet(ADDRINT ip, ADDRINT target, BOOL taken)
-{
-    OutFile << std::hex
-            << (ip & 0xffffffff)             // PC
-            << "\t" << (target & 0xffffffff) // Target
-            << (taken ? "\t1" : "\t0")       // T-N
-            << "\t0"                         // Unconditional
-            << "\t0"                         // Not Call
-            << "\t1"                         // Ret
-            << "\t1"                         // Direct
-            << "\n"
-            << flush;
-    ubcount++;
-    retcount++;
-}
-
-static VOID UnconUnDirectRet(ADDRINT ip, ADDRINT target, BOOL taken)
-{
-    OutFile << std::hex
-            << (ip & 0xffffffff)             // PC
-            << "\t" << (target & 0xffffffff) // Target
-            << (taken ? "\t1" : "\t0")       // T-N
-            << "\t0"                         // Unconditional
-            << "\t0"                         // Not Call
-            << "\t1"                         // Ret
-            << "\t0"                         // Not Direct
-            << "\n"
-            << flush;
-    ubcount++;
-    retcount++;
-}
-
-static VOID ConDirectRet(ADDRINT ip, ADDRINT target, BOOL taken)
-{
-    OutFile << std::hex
-            << (ip & 0xffffffff)             // PC
-            << "\t" << (target & 0xffffffff) // Target
-            << (taken ? "\t1" : "\t0")       // T-N
-            << "\t1"                         // Unconditional
-            << "\t0"                         // Not Call
-            << "\t1"                         // Not Ret
-            << "\t1"                         // Direct
-            << "\n"
-            << flush;
-    cbcount++;
-    retcount++;
-}
-static VOID ConUnDirectRet(ADDRINT ip, ADDRINT target, BOOL taken)
-{
-    OutFile << std::hex
-            << (ip & 0xffffffff)             // PC
-            << "\t" << (target & 0xffffffff) // Target
-            << (taken ? "\t1" : "\t0")       // T-N
-            << "\t1"                         // Unconditional
-            << "\t0"                         // Not Call
-            << "\t1"                         // Not Ret
-            << "\t0"                         // Direct
-            << "\n"
-            << flush;
-    cbcount++;
-    retcount++;
-}
-//****************************************************************
+static VOID Instruction(INS ins)
+{
+    if (INS_IsValidForIpointTakenBranch(ins))
+    {
+        UINT32 flags = 0;
+        if (INS_HasFallThrough(ins))
+            flags |= TRACE_COND; // It is conditional branch
+        if (INS_IsCall(ins))
+            flags |= TRACE_CALL;
+        else if (INS_IsRet(ins))
+            flags |= TRACE_RET;
+        if (INS_IsDirectControlFlow(ins))
+            flags |= TRACE_DIRECT;
+
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordBranch,
+                         IARG_REG_VALUE, tlsReg,
+                         IARG_UINT32, (flags & TRACE_COND) ? 1 : 0,
+                         IARG_END);
+        UINT32 recordFlags = flags | (INS_Size(ins) << RECORD_LENGTH_SHIFT);
+        UINT32 id = KnobDictionary ? branch_id(ins, flags) : 0;
+        // -context follows the calls by their address and target
+        if (compactRecords && !(KnobContext && (flags & TRACE_CALL)))
+        {
+            // The dictionary has the PC and the direct targets
+            if (flags & TRACE_DIRECT)
+                INS_InsertFillBufferThen(ins, IPOINT_BEFORE, bufId,
+                                         IARG_UINT32, recordFlags, offsetof(BRANCH_RECORD, flags),
+                                         IARG_UINT32, id, offsetof(BRANCH_RECORD, id),
+                                         IARG_BRANCH_TAKEN, offsetof(BRANCH_RECORD, taken),
+                                         IARG_REG_VALUE, icountReg, offsetof(BRANCH_RECORD, icount),
+                                         IARG_END);
+            else
+                INS_InsertFillBufferThen(ins, IPOINT_BEFORE, bufId,
+                                         IARG_BRANCH_TARGET_ADDR, offsetof(BRANCH_RECORD, target),
+                                         IARG_UINT32, recordFlags, offsetof(BRANCH_RECORD, flags),
+                                         IARG_UINT32, id, offsetof(BRANCH_RECORD, id),
+                                         IARG_BRANCH_TAKEN, offsetof(BRANCH_RECORD, taken),
+                                         IARG_REG_VALUE, icountReg, offsetof(BRANCH_RECORD, icount),
+                                         IARG_END);
+        }
+        else
+        {
+            INS_InsertFillBufferThen(ins, IPOINT_BEFORE, bufId,
+                                     IARG_INST_PTR, offsetof(BRANCH_RECORD, pc),
+                                     IARG_BRANCH_TARGET_ADDR, offsetof(BRANCH_RECORD, target),
+                                     IARG_UINT32, recordFlags, offsetof(BRANCH_RECORD, flags),
+                                     IARG_UINT32, id, offsetof(BRANCH_RECORD, id),
+                                     IARG_BRANCH_TAKEN, offsetof(BRANCH_RECORD, taken),
+                                     IARG_REG_VALUE, icountReg, offsetof(BRANCH_RECORD, icount),
+                                     IARG_END);
+        }
+        // After the fill, so the branch reaching -max_cond_branches is still recorded
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)BranchDue, IARG_REG_VALUE, tlsReg, IARG_END);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)BranchEvent, IARG_REG_VALUE, tlsReg, IARG_REG_VALUE, icountReg, IARG_END);
+    }
+    else if (KnobPredicated && predicate_code(ins) >= 0)
+        InstrumentPredicated(ins, predicate_code(ins));
+    else if (KnobRep && INS_HasRealRep(ins))
+        InstrumentRep(ins);
+    // We do not care about the other instructions.
+}
 
 /************
  *
- * Call segment
+ * Code filter
  *
+ * Code that is not selected gets no instrumentation of ours at all: its
+ * branches are not recorded and its instructions are not counted, so the
+ * instruction counts of the sets only cover the selected code. Every
+ * filter that is given must select the code.
  */
-static VOID UnconDirectCall(ADDRINT ip, ADDRINT target, BOOL taken)
-{
-    OutFile << std::hex
-            << (ip & 0xffffffff)             // PC
-            << "\t" << (target & 0xffffffff) // Target
-            << (taken ? "\t1" : "\t0")       // T-N
-            << "\t0"                         // Unconditional
-            << "\t1"                         // Not Call
-            << "\t0"                         // Not Ret
-            << "\t1"                         // Direct
-            << "\n"
-            << flush;
-    ubcount++;
-    callcount++;
-}
-static VOID UnconUnDirectCall(ADDRINT ip, ADDRINT target, BOOL taken)
-{
-    OutFile << std::hex
-            << (ip & 0xffffffff)             // PC
-            << "\t" << (target & 0xffffffff) // Target
-            << (taken ? "\t1" : "\t0")       // T-N
-            << "\t0"                         // Unconditional
-            << "\t1"                         // Not Call
-            << "\t0"                         // Not Ret
-            << "\t0"                         // Direct
-            << "\n"
-            << flush;
-    ubcount++;
-    callcount++;
-}
-static VOID ConDirectCall(ADDRINT ip, ADDRINT target, BOOL taken)
-{
-    OutFile << std::hex
-            << (ip & 0xffffffff)             // PC
-            << "\t" << (target & 0xffffffff) // Target
-            << (taken ? "\t1" : "\t0")       // T-N
-            << "\t1"                         // Unconditional
-            << "\t1"                         // Not Call
-            << "\t0"                         // Not Ret
-            << "\t1"                         // Direct
-            << "\n"
-            << flush;
-    cbcount++;
-    callcount++;
-}
-static VOID ConUnDirectCall(ADDRINT ip, ADDRINT target, BOOL taken)
-{
-    OutFile << std::hex
-            << (ip & 0xffffffff)             // PC
-            << "\t" << (target & 0xffffffff) // Target
-            << (taken ? "\t1" : "\t0")       // T-N
-            << "\t1"                         // Unconditional
-            << "\t1"                         // Not Call
-            << "\t0"                         // Not Ret
-            << "\t0"                         // Direct
-            << "\n"
-            << flush;
-    cbcount++;
-    callcount++;
-}
-//****************************************************************
-
-static VOID Instruction(INS ins, VOID *v)
-{
-    // Insert a call to docount before every instruction, no arguments are passed
-
-    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount, IARG_END);
-
-    if (record)
-    {
-        if (INS_IsValidForIpointTakenBranch(ins))
+
+static vector<pair<ADDRINT, ADDRINT> > filterRanges; // [start, end) of -filter_range
+
+static BOOL parse_filter_ranges()
+{
+    for (UINT32 i = 0; i < KnobFilterRange.NumberOfValues(); i++)
+    {
+        unsigned long long start, end;
+        if (sscanf(KnobFilterRange.Value(i).c_str(), "%llx:%llx", &start, &end) != 2 || start >= end)
+            return FALSE;
+        filterRanges.push_back(make_pair((ADDRINT)start, (ADDRINT)end));
+    }
+    return TRUE;
+}
+
+static BOOL select_image(ADDRINT addr)
+{
+    UINT32 numImages = KnobFilterImage.NumberOfValues();
+    if (numImages == 0)
+        return TRUE;
+
+    IMG img = IMG_FindByAddress(addr);
+    if (!IMG_Valid(img))
+        return FALSE;
+    const string &name = IMG_Name(img);
+    string file = name.substr(name.rfind('/') + 1);
+    for (UINT32 i = 0; i < numImages; i++)
+    {
+        if (KnobFilterImage.Value(i) == name || KnobFilterImage.Value(i) == file)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Decided per basic block, as a trace may run across the end of a range
+static BOOL select_range(ADDRINT addr)
+{
+    if (filterRanges.empty())
+        return TRUE;
+
+    for (UINT32 i = 0; i < filterRanges.size(); i++)
+    {
+        if (addr >= filterRanges[i].first && addr < filterRanges[i].second)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static VOID Trace(TRACE trace, VOID *v)
+{
+    // Outside of the regions the code runs without any instrumentation of
+    // ours. With -sample_period it only counts instructions between the
+    // windows, the branches are instrumented again when a window starts
+    if (!record && samplePeriod == 0)
+        return;
+    if (!filter.SelectTrace(trace) || !select_image(TRACE_Address(trace)))
+        return;
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        if (!select_range(BBL_Address(bbl)))
+            continue;
+        BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)CountBlock,
+                       IARG_REG_VALUE, icountReg, IARG_UINT32, BBL_NumIns(bbl),
+                       IARG_RETURN_REGS, icountReg, IARG_END);
+        if (samplePeriod > 0)
         {
-            if (first_record)
-            { // Detected the first branch
-                first_inst_count_after_offset = 1;
-                first_record = false;
-            }
-            if (INS_HasFallThrough(ins) == false)
-            { // It is unconditional branch
-                if (INS_IsCall(ins))
-                { // It is call
-                    if (INS_IsDirectControlFlow(ins) == true)
-                    { // direct
-                        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)UnconDirectCall, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_END);
-                    }
-                    else
-                    {
-                        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)UnconUnDirectCall, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_END);
-                    }
-                }
-                else if (INS_IsRet(ins))
-                { // It is RET
-                    if (INS_IsDirectControlFlow(ins) == true)
-                    {
-                        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)UnconDirectRet, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_END);
-                    }
-                    else
-                    {
-                        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)UnconUnDirectRet, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_END);
-                    }
-                }
-                else
-                { // It is JMP
-                    if (INS_IsDirectControlFlow(ins) == true)
-                    {
-                        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)UnconDirectJMP, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_END);
-                    }
-                    else
-                    {
-                        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)UnconUnDirectJMP, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_END);
-                    }
-                }
-            }
-            else
-            { // It is conditional branch
-                if (INS_IsCall(ins))
-                { // It is call
-                    if (INS_IsDirectControlFlow(ins) == true)
-                    { // direct
-                        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ConDirectCall, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_END);
-                    }
-                    else
-                    {
-                        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ConUnDirectCall, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_END);
-                    }
-                }
-                else if (INS_IsRet(ins))
-                { // It is RET
-                    if (INS_IsDirectControlFlow(ins) == true)
-                    {
-                        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ConDirectRet, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_END);
-                    }
-                    else
-                    {
-                        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ConUnDirectRet, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_END);
-                    }
-                }
-                else
-                { // It is JMP
-                    if (INS_IsDirectControlFlow(ins) == true)
-                    {
-                        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ConDirectJMP, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_END);
-                    }
-                    else
-                    {
-                        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ConUnDirectJMP, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_BRANCH_TAKEN, IARG_END);
-                    }
-                }
-            }
+            BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)WindowDue,
+                             IARG_REG_VALUE, tlsReg, IARG_REG_VALUE, icountReg, IARG_END);
+            BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)WindowStart,
+                               IARG_REG_VALUE, tlsReg, IARG_REG_VALUE, icountReg, IARG_END);
         }
+
+        if (!record)
+            continue;
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+            Instruction(ins);
+        if (loadSlice > 0)
+            InstrumentBranchLoads(bbl);
     }
-    // We do not care about instrunctions that are not branches.
-    // else
-    //    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)AtNonBranch, IARG_INST_PTR, IARG_END);
+}
+
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    THREAD_DATA *td = new THREAD_DATA();
+    td->tid = tid;
+    td->nextBranchEvent = (UINT64)-1;
+    td->nextWindow = (samplePeriod > 0) ? samplePeriod : (UINT64)-1;
+    PIN_SetThreadData(tlsKey, td, tid);
+    PIN_SetContextReg(ctxt, tlsReg, (ADDRINT)td);
+    PIN_SetContextReg(ctxt, icountReg, 0);
+    // Nothing has been recorded yet, so this is the start of the buffer
+    td->bufferBase = PIN_GetBufferPointer(ctxt, bufId);
+
+    PIN_MutexLock(&threadLock);
+    threads.push_back(td);
+    PIN_MutexUnlock(&threadLock);
+
+    // Threads started inside a region that was broadcast to all threads
+    if (allThreads)
+        start_region(td, 0);
+}
+
+// The trace buffer of the thread has been flushed by BufferFull at this point
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    THREAD_DATA *td = get_thread_data(tid);
+
+    if (td->record)
+        update_recording(-1);
+    close_thread(td, PIN_GetContextReg(ctxt, icountReg));
 }
 
 /* ===================================================================== */
@@ -535,40 +2217,101 @@ INT32 Usage()
 
 INT32 InitFile()
 {
-    filePrefix.str("");
-    filePrefix.clear();
-    filePrefix << KnobOutputFile.Value() << "_" << fileCounter << ".out";
-    OutFile.open(filePrefix.str().c_str());
-    OutFile.setf(ios::showbase);
-
-    filePrefix.str("");
-    filePrefix.clear();
-    filePrefix << axuliryFileName << "_" << fileCounter << ".out";
-    axuFile.open(filePrefix.str().c_str());
-    axuFile.setf(ios::showbase);
-
-    howManyBranch = strtoull(KnobHowManyBranch.Value().c_str(), NULL, 0);
     howManySet = strtoull(KnobHowManySet.Value().c_str(), NULL, 0);
-    offset_inst = strtoull(KnobOffset.Value().c_str(), NULL, 0);
-    cout << "My offset " << offset_inst << endl;
-
-    cout << KnobHowManyBranch.Value() << endl;
+    maxCondBranches = KnobMaxCondBranches.Value();
+    samplePeriod = KnobSamplePeriod.Value();
 
     return 0;
 }
 
 int main(INT32 argc, CHAR **argv)
 {
-    PIN_Init(argc, argv);
+    if (PIN_Init(argc, argv))
+        return Usage();
     PIN_InitSymbols();
 
+    if (KnobCompress.Value() != "bz2" && KnobCompress.Value() != "none")
+        return Usage();
+    if (!parse_filter_ranges())
+        return Usage();
+    compactRecords = KnobDictionary && !KnobTextOutput && KnobShm.Value().empty();
+    loadSlice = KnobLoads;
+
+#ifdef ONLINE_PREDICTOR
+    // The predictors need the PC of every branch
+    compactRecords = FALSE;
+    loadSlice = 0;
+    bpType = -1;
+    for (int i = STATIC; i <= CUSTOM; i++)
+    {
+        if (strcasecmp(KnobPredictor.Value().c_str(), bpName[i]) == 0)
+            bpType = i;
+    }
+    if (bpType < 0)
+        return Usage();
+    verbose = 0;
+    init_predictor();
+    PIN_MutexInit(&predictorLock);
+#else
+    compressBz2 = (KnobCompress.Value() == "bz2");
+    if (!KnobShm.Value().empty() && !attach_shm(KnobShm.Value()))
+    {
+        cerr << "Error: no ring " << KnobShm.Value() << ", start 'predictor --shm=" << KnobShm.Value() << "' first" << endl;
+        return 1;
+    }
+#endif
+
+    if (KnobFollowChild)
+        start_process_tree();
+    start_writer();
     InitFile();
+    if (KnobWindowMs > 0)
+        start_window_timer();
+    if (KnobProgressMs > 0)
+        start_progress();
+    if (PIN_IsAttaching())
+        cout << "Attached to process " << PIN_GetPid() << endl;
+
+    bufId = PIN_DefineTraceBuffer(sizeof(BRANCH_RECORD), KnobNumPagesInBuffer.Value(), BufferFull, 0);
+    if (bufId == BUFFER_ID_INVALID)
+    {
+        cerr << "Error: could not allocate the trace buffer" << endl;
+        return 1;
+    }
+
+    tlsKey = PIN_CreateThreadDataKey(NULL);
+    tlsReg = PIN_ClaimToolRegister();
+    icountReg = PIN_ClaimToolRegister();
+    valueReg = KnobLoadValues ? PIN_ClaimToolRegister() : REG_INVALID();
+    if (tlsKey == INVALID_TLS_KEY || !REG_valid(tlsReg) || !REG_valid(icountReg) ||
+        (KnobLoadValues && !REG_valid(valueReg)))
+    {
+        cerr << "Error: could not allocate the thread data" << endl;
+        return 1;
+    }
+    PIN_MutexInit(&threadLock);
 
-    INS_AddInstrumentFunction(Instruction, 0);
+    // Before the controller, so the thread data exists when it fires an event
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
+    TRACE_AddInstrumentFunction(Trace, 0);
     IMG_AddInstrumentFunction(ImageLoad, 0);
 
+    // With the context, which holds the instruction count of the thread
+    control.RegisterHandler(ControlHandler, 0, TRUE);
+    control.Activate();
+    filter.Activate();
+
     // Register Fini to be called when the application exits
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
     PIN_AddFiniFunction(Fini, 0);
+    PIN_AddThreadDetachFunction(ThreadDetach, 0);
+    PIN_AddDetachFunction(Detach, 0);
+    if (KnobFollowChild)
+    {
+        PIN_AddForkFunction(FPOINT_AFTER_IN_CHILD, ForkChild, 0);
+        PIN_AddFollowChildProcessFunction(FollowChild, 0);
+    }
 
     PIN_StartProgram();
     return 0;
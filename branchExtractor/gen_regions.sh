@@ -0,0 +1,17 @@
+#!/bin/bash
+# Usage: gen_regions.sh <regions.csv> <suite_dir> <program> [args...]
+BRANCH_EXT_ROOT=$(dirname $(realpath -s $0))
+REGIONS=$(realpath "$1")
+SUITE=$2
+shift 2
+
+make -C ${BRANCH_EXT_ROOT}
+mkdir -p "$SUITE"
+
+# Every region of the CSV, in one run, ends at its own length instead of
+# -max_cond_branches. The sets are compressed by one writer thread per core
+${BRANCH_EXT_ROOT}/pin_tool/pin -t ${BRANCH_EXT_ROOT}/obj-intel64/branchExt.so -regions:in "$REGIONS" -max_cond_branches 0 -writers $(nproc) -o "$SUITE/branches" -- "$@"
+
+# One branches_<region>.out.bz2 and generalInfo_<region>.out per region,
+# all with the same branches.dict
+mv generalInfo_*.out "$SUITE/"
@@ -0,0 +1,361 @@
+//========================================================//
+//  bench.cpp                                             //
+//  Predictor throughput microbenchmark                   //
+//                                                        //
+//  Measures predict+train throughput of each predictor   //
+//  on in-memory branch buffers, without any trace I/O    //
+//========================================================//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "predictor.h"
+#include "trace_reader.h"
+#include "branch_dict.h"
+#include "stage_timer.h"
+
+//------------------------------------//
+//          Bench Defines             //
+//------------------------------------//
+
+#define BENCH_DEFAULT_BRANCHES 4000000
+#define BENCH_DEFAULT_REPS 5
+#define BENCH_EVICT_BYTES (64 << 20)  // larger than any host last-level cache
+
+// One decoded trace line
+typedef struct
+{
+  uint64_t pc;
+  uint64_t target;
+  uint8_t outcome;
+  uint8_t condition;
+  uint8_t call;
+  uint8_t ret;
+  uint8_t direct;
+} bench_branch;
+
+typedef struct
+{
+  const char *name;
+  bench_branch *branches;
+  uint32_t count;
+} bench_buffer;
+
+// A predictor type together with one table size configuration
+typedef struct
+{
+  int type;
+  int size;   // ghistoryBits for gshare, lhtBits for tournament, unused otherwise
+} bench_config;
+
+uint32_t benchBranches = BENCH_DEFAULT_BRANCHES;
+int benchReps = BENCH_DEFAULT_REPS;
+const char *tracePath = NULL;
+const char *dictPath = NULL;     // static branch dictionary of a compact trace
+
+uint8_t *evict_buf;
+uint32_t rng_state = 0x12345678;
+
+//------------------------------------//
+//         Bench Functions            //
+//------------------------------------//
+
+void usage()
+{
+  fprintf(stderr, "Usage: bench <options>\n");
+  fprintf(stderr, " Options:\n");
+  fprintf(stderr, " --help          Print this message\n");
+  fprintf(stderr, " --trace=<file>  Also run on a trace (text, binary or compact, not\n"
+                  "                 compressed), loaded into memory\n");
+  fprintf(stderr, " --dict=<file>   Branch dictionary of a compact --trace\n");
+  fprintf(stderr, " --branches=N    Branches per synthetic buffer (default %d)\n", BENCH_DEFAULT_BRANCHES);
+  fprintf(stderr, " --reps=N        Timed repetitions per measurement (default %d)\n", BENCH_DEFAULT_REPS);
+}
+
+static uint32_t next_random()
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+static void set_branch(bench_branch *b, uint32_t pc, uint32_t outcome)
+{
+  b->pc = pc;
+  b->target = pc + 0x40;
+  b->outcome = outcome;
+  b->condition = 1;
+  b->call = 0;
+  b->ret = 0;
+  b->direct = 1;
+}
+
+// Nested loops: an inner loop of 8 iterations inside an outer loop
+// of 100, as a small, almost perfectly predictable working set
+//
+static void make_loops(bench_buffer *buf)
+{
+  buf->name = "loops";
+  buf->count = benchBranches;
+  buf->branches = (bench_branch *)malloc(buf->count * sizeof(bench_branch));
+  for (uint32_t i = 0; i < buf->count; i++)
+  {
+    uint32_t inner = i % 9;
+    if (inner < 8)
+    {
+      set_branch(&buf->branches[i], 0x400100, inner != 7);
+    }
+    else
+    {
+      set_branch(&buf->branches[i], 0x400180, (i / 9) % 100 != 99);
+    }
+  }
+}
+
+// Random outcomes over 64K static branches: stresses the table
+// footprint and the host caches
+//
+static void make_random(bench_buffer *buf)
+{
+  buf->name = "random";
+  buf->count = benchBranches;
+  buf->branches = (bench_branch *)malloc(buf->count * sizeof(bench_branch));
+  for (uint32_t i = 0; i < buf->count; i++)
+  {
+    uint32_t r = next_random();
+    set_branch(&buf->branches[i], 0x400000 + ((r >> 16) << 2), r & 1);
+  }
+}
+
+// Loads a trace in any format the simulator reads (text, binary or
+// compact, see trace_reader.h). The trace must not be compressed
+//
+// Returns True if Successful
+//
+static int load_trace(bench_buffer *buf, const char *path)
+{
+  stream = fopen(path, "r");
+  if (stream == NULL || !open_trace())
+  {
+    close_trace();
+    return 0;
+  }
+
+  uint32_t capacity = 1 << 20;
+  uint64_t pc, target;
+  uint32_t outcome, condition, call, ret, direct, insts;
+
+  buf->name = "trace";
+  buf->count = 0;
+  buf->branches = (bench_branch *)malloc(capacity * sizeof(bench_branch));
+  while (read_record())
+  {
+    if (!parse_branch(&pc, &target, &outcome, &condition, &call, &ret, &direct, &insts))
+    {
+      continue;
+    }
+    if (buf->count == capacity)
+    {
+      capacity <<= 1;
+      buf->branches = (bench_branch *)realloc(buf->branches, capacity * sizeof(bench_branch));
+    }
+    bench_branch *b = &buf->branches[buf->count++];
+    b->pc = pc;
+    b->target = target;
+    b->outcome = outcome;
+    b->condition = condition;
+    b->call = call;
+    b->ret = ret;
+    b->direct = direct;
+  }
+  close_trace();
+
+  return 1;
+}
+
+// Selects the predictor of 'cfg'. The sizes start from the defaults of
+// predictor.cpp, so a config does not inherit the size of the one before
+//
+static void configure(const bench_config *cfg)
+{
+  static const int default_ghistoryBits = ghistoryBits;
+  static const int default_lhtBits = lhtBits;
+
+  bpType = cfg->type;
+  ghistoryBits = default_ghistoryBits;
+  lhtBits = default_lhtBits;
+  if (cfg->type == GSHARE)
+  {
+    ghistoryBits = cfg->size;
+  }
+  else if (cfg->type == TOURNAMENT)
+  {
+    lhtBits = cfg->size;
+  }
+}
+
+// Writes a buffer larger than the last-level cache so the predictor
+// tables and the branch buffer start cold
+//
+static void evict_caches()
+{
+  for (uint32_t i = 0; i < BENCH_EVICT_BYTES; i += 64)
+  {
+    evict_buf[i]++;
+  }
+}
+
+// Runs predict+train over the whole buffer
+//
+// Returns the number of mispredictions
+//
+static uint32_t run_buffer(const bench_buffer *buf)
+{
+  uint32_t mispredictions = 0;
+  for (uint32_t i = 0; i < buf->count; i++)
+  {
+    const bench_branch *b = &buf->branches[i];
+    if (b->condition)
+    {
+      mispredictions += (make_prediction(b->pc, b->target, b->direct) != b->outcome);
+    }
+    train_predictor(b->pc, b->target, b->outcome, b->condition, b->call, b->ret, b->direct);
+  }
+  return mispredictions;
+}
+
+// Times 'benchReps' runs of one predictor configuration on one buffer and
+// prints the mean and standard deviation of the throughput
+//
+static void measure(const bench_config *cfg, const bench_buffer *buf, int warm)
+{
+  double sum = 0;
+  double sum_sq = 0;
+  uint32_t mispredictions = 0;
+  uint32_t conditional = 0;
+
+  for (uint32_t i = 0; i < buf->count; i++)
+  {
+    conditional += buf->branches[i].condition;
+  }
+
+  for (int rep = 0; rep < benchReps; rep++)
+  {
+    configure(cfg);
+    init_predictor();
+    if (warm)
+    {
+      run_buffer(buf);
+    }
+    else
+    {
+      evict_caches();
+    }
+
+    uint64_t start = stage_now();
+    mispredictions = run_buffer(buf);
+    uint64_t elapsed = stage_now() - start;
+    cleanup_predictor();
+
+    double rate = 1e3 * buf->count / (double)elapsed;  // Mbranches/s
+    sum += rate;
+    sum_sq += rate * rate;
+  }
+
+  double mean = sum / benchReps;
+  double var = (benchReps > 1) ? (sum_sq - benchReps * mean * mean) / (benchReps - 1) : 0;
+  double stddev = (var > 0) ? sqrt(var) : 0;
+
+  printf("%-10s %4d  %-7s %-4s %10.2f %8.2f %7.2f%% %9.3f\n",
+         bpName[cfg->type], cfg->size, buf->name, warm ? "warm" : "cold",
+         mean, stddev, 100 * stddev / mean,
+         1000 * (double)mispredictions / (double)(conditional ? conditional : 1));
+}
+
+int main(int argc, char *argv[])
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "--help"))
+    {
+      usage();
+      exit(0);
+    }
+    else if (!strncmp(argv[i], "--trace=", 8))
+    {
+      tracePath = argv[i] + 8;
+    }
+    else if (!strncmp(argv[i], "--dict=", 7))
+    {
+      dictPath = argv[i] + 7;
+    }
+    else if (!strncmp(argv[i], "--branches=", 11))
+    {
+      benchBranches = strtoul(argv[i] + 11, NULL, 0);
+    }
+    else if (!strncmp(argv[i], "--reps=", 7))
+    {
+      benchReps = atoi(argv[i] + 7);
+    }
+    else
+    {
+      printf("Unrecognized option %s\n", argv[i]);
+      usage();
+      exit(1);
+    }
+  }
+  if (benchReps < 1)
+  {
+    benchReps = 1;
+  }
+
+  bench_buffer buffers[3];
+  int num_buffers = 0;
+  make_loops(&buffers[num_buffers++]);
+  make_random(&buffers[num_buffers++]);
+  if (dictPath != NULL && !load_branch_dict(dictPath))
+  {
+    fprintf(stderr, "Could not read the branch dictionary %s\n", dictPath);
+    exit(1);
+  }
+  if (tracePath != NULL)
+  {
+    if (!load_trace(&buffers[num_buffers], tracePath))
+    {
+      fprintf(stderr, "Could not read %s\n", tracePath);
+      exit(1);
+    }
+    num_buffers++;
+  }
+
+  evict_buf = (uint8_t *)calloc(BENCH_EVICT_BYTES, 1);
+
+  bench_config configs[] = {
+      {STATIC, 0},
+      {GSHARE, 10}, {GSHARE, 14}, {GSHARE, 17}, {GSHARE, 20},
+      {TOURNAMENT, 10}, {TOURNAMENT, 15},
+      {CUSTOM, 0},
+  };
+  int num_configs = sizeof(configs) / sizeof(configs[0]);
+
+  printf("%-10s %4s  %-7s %-4s %10s %8s %8s %9s\n",
+         "Predictor", "Bits", "Buffer", "Mode", "Mbranch/s", "StdDev", "RelSD", "MissRate");
+  for (int c = 0; c < num_configs; c++)
+  {
+    for (int b = 0; b < num_buffers; b++)
+    {
+      measure(&configs[c], &buffers[b], 0);
+      measure(&configs[c], &buffers[b], 1);
+    }
+  }
+
+  for (int b = 0; b < num_buffers; b++)
+  {
+    free(buffers[b].branches);
+  }
+  free(evict_buf);
+
+  return 0;
+}
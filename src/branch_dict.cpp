@@ -0,0 +1,133 @@
+//========================================================//
+//  branch_dict.cpp                                       //
+//  Source file for the static branch dictionary          //
+//                                                        //
+//  The branches are kept sorted by PC for the lookups of //
+//  the profile, with an id table for the trace reader    //
+//========================================================//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "branch_dict.h"
+#include "trace_format.h"
+
+//------------------------------------//
+//  Branch Dictionary Data Structures //
+//------------------------------------//
+
+dict_branch *dict_entries;  // sorted by PC
+uint32_t dict_count;
+dict_branch **dict_by_id;
+uint32_t dict_size;
+
+//------------------------------------//
+//    Branch Dictionary Functions     //
+//------------------------------------//
+
+static int compare_pc(const void *a, const void *b)
+{
+  const dict_branch *x = (const dict_branch *)a;
+  const dict_branch *y = (const dict_branch *)b;
+  return (x->pc < y->pc) ? -1 : (x->pc > y->pc) ? 1 : 0;
+}
+
+// Splits 'line' at tabs into at most 'max' columns, the last one keeps
+// the rest of the line (the disassembly). Returns the number of columns
+//
+static int split_columns(char *line, char **cols, int max)
+{
+  int n = 0;
+  line[strcspn(line, "\n")] = '\0';
+  while (n < max - 1)
+  {
+    cols[n++] = line;
+    char *tab = strchr(line, '\t');
+    if (tab == NULL)
+    {
+      return n;
+    }
+    *tab = '\0';
+    line = tab + 1;
+  }
+  cols[n++] = line;
+  return n;
+}
+
+int load_branch_dict(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+  {
+    return 0;
+  }
+
+  uint32_t capacity = 1 << 12;
+  dict_entries = (dict_branch *)malloc(capacity * sizeof(dict_branch));
+  dict_count = 0;
+  dict_size = 0;
+
+  char *line = NULL;
+  size_t len = 0;
+  char *cols[DICT_COLUMNS];
+  while (getline(&line, &len, f) != -1)
+  {
+    if (line[0] == '#' || split_columns(line, cols, DICT_COLUMNS) != DICT_COLUMNS)
+    {
+      continue;
+    }
+    if (dict_count == capacity)
+    {
+      capacity <<= 1;
+      dict_entries = (dict_branch *)realloc(dict_entries, capacity * sizeof(dict_branch));
+    }
+
+    // cols[3] is the class name, a readable form of the flags
+    dict_branch *b = &dict_entries[dict_count++];
+    b->id = strtoul(cols[0], NULL, 0);
+    b->pc = strtoull(cols[1], NULL, 0);
+    b->flags = strtoul(cols[2], NULL, 0);
+    b->length = strtoul(cols[4], NULL, 0);
+    b->target = strtoull(cols[5], NULL, 0);
+    b->fallthrough = strtoull(cols[6], NULL, 0);
+    b->image = strdup(cols[7]);
+    b->routine = strdup(cols[8]);
+    b->disasm = strdup(cols[9]);
+    if (b->id >= dict_size)
+    {
+      dict_size = b->id + 1;
+    }
+  }
+  free(line);
+  fclose(f);
+
+  // the id table points into the sorted array, so it is built last
+  qsort(dict_entries, dict_count, sizeof(dict_branch), compare_pc);
+  dict_by_id = (dict_branch **)calloc(dict_size, sizeof(dict_branch *));
+  for (uint32_t i = 0; i < dict_count; i++)
+  {
+    dict_by_id[dict_entries[i].id] = &dict_entries[i];
+  }
+
+  return 1;
+}
+
+const dict_branch *dict_branch_by_pc(uint64_t pc)
+{
+  dict_branch key;
+  key.pc = pc;
+  return (const dict_branch *)bsearch(&key, dict_entries, dict_count, sizeof(dict_branch), compare_pc);
+}
+
+void cleanup_branch_dict()
+{
+  for (uint32_t i = 0; i < dict_count; i++)
+  {
+    free(dict_entries[i].image);
+    free(dict_entries[i].routine);
+    free(dict_entries[i].disasm);
+  }
+  free(dict_entries);
+  free(dict_by_id);
+  dict_count = 0;
+  dict_size = 0;
+}
@@ -0,0 +1,60 @@
+//========================================================//
+//  branch_dict.h                                         //
+//  Header file for the static branch dictionary          //
+//                                                        //
+//  Loads the dictionary branchExt writes next to its     //
+//  traces (see trace_format.h), indexed by id and by PC  //
+//========================================================//
+
+#ifndef BRANCH_DICT_H
+#define BRANCH_DICT_H
+
+#include <stdint.h>
+
+//------------------------------------//
+//    Branch Dictionary Structures    //
+//------------------------------------//
+
+typedef struct
+{
+  uint32_t id;
+  uint64_t pc;
+  uint64_t target;       // 0 for indirect branches
+  uint64_t fallthrough;
+  uint32_t flags;        // TRACE_* bits without TRACE_TAKEN
+  uint32_t length;
+  char *image;
+  char *routine;
+  char *disasm;
+} dict_branch;
+
+extern dict_branch **dict_by_id;  // indexed by id, NULL for ids not in the file
+extern uint32_t dict_size;        // largest id + 1, 0 without a dictionary
+
+//------------------------------------//
+//  Branch Dictionary Prototypes      //
+//------------------------------------//
+
+// Load the dictionary at 'path'
+//
+// Returns True if Successful
+//
+int load_branch_dict(const char *path);
+
+// The branch with dictionary id 'id', NULL if there is none. Called
+// for every record of a compact trace
+//
+static inline const dict_branch *dict_branch_by_id(uint32_t id)
+{
+  return (id < dict_size) ? dict_by_id[id] : NULL;
+}
+
+// The branch at 'pc', NULL if it is not in the dictionary
+//
+const dict_branch *dict_branch_by_pc(uint64_t pc);
+
+// Free the dictionary
+//
+void cleanup_branch_dict();
+
+#endif
@@ -0,0 +1,160 @@
+//========================================================//
+//  branch_profile.cpp                                    //
+//  Source file for the per-branch misprediction profile  //
+//                                                        //
+//  Open-addressing hash table (linear probing) keyed by  //
+//  the branch PC, grown when it becomes half full        //
+//========================================================//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "branch_profile.h"
+#include "branch_dict.h"
+
+//------------------------------------//
+//    Branch Profile Data Structures  //
+//------------------------------------//
+
+// One slot of the profile table. A slot is free while execs == 0
+typedef struct
+{
+  uint64_t pc;
+  uint32_t execs;
+  uint32_t mispredicts;
+  uint32_t taken;
+} profile_entry;
+
+profile_entry *profile_table;
+uint32_t profile_slots;   // table size, always a power of two
+uint32_t profile_used;    // number of occupied slots
+uint32_t profile_topN;
+
+//------------------------------------//
+//     Branch Profile Functions       //
+//------------------------------------//
+
+// Fibonacci hashing spreads the (mostly aligned) PCs over the whole table;
+// the high half of the product depends on every bit of the 64-bit PC. A
+// macro, as the simulator is built without optimization
+#define PROFILE_HASH(pc) ((uint32_t)(((pc) * 0x9e3779b97f4a7c15ull) >> 32) & (profile_slots - 1))
+
+static profile_entry *profile_lookup(uint64_t pc)
+{
+  uint32_t idx = PROFILE_HASH(pc);
+  while (profile_table[idx].execs != 0 && profile_table[idx].pc != pc)
+  {
+    idx = (idx + 1) & (profile_slots - 1);
+  }
+  return &profile_table[idx];
+}
+
+static void profile_grow()
+{
+  profile_entry *old_table = profile_table;
+  uint32_t old_slots = profile_slots;
+
+  profile_slots = old_slots << 1;
+  profile_table = (profile_entry *)calloc(profile_slots, sizeof(profile_entry));
+  for (uint32_t i = 0; i < old_slots; i++)
+  {
+    if (old_table[i].execs != 0)
+    {
+      *profile_lookup(old_table[i].pc) = old_table[i];
+    }
+  }
+  free(old_table);
+}
+
+void init_branch_profile(uint32_t topN)
+{
+  profile_slots = PROFILE_INIT_SLOTS;
+  profile_used = 0;
+  profile_topN = topN;
+  profile_table = (profile_entry *)calloc(profile_slots, sizeof(profile_entry));
+}
+
+void profile_branch(uint64_t pc, uint32_t outcome, uint32_t prediction)
+{
+  // Most branches are found in their home slot, which is checked here
+  // without the calls of the probe loop
+  profile_entry *entry = &profile_table[PROFILE_HASH(pc)];
+  if (entry->pc != pc && entry->execs != 0)
+  {
+    entry = profile_lookup(pc);
+  }
+
+  if (entry->execs == 0)
+  {
+    // first time we see this branch. Keep the load factor under 1/2
+    // so probe sequences stay short
+    if (++profile_used > (profile_slots >> 1))
+    {
+      profile_grow();
+      entry = profile_lookup(pc);
+    }
+    entry->pc = pc;
+  }
+
+  entry->execs++;
+  entry->taken += outcome;
+  entry->mispredicts += (prediction != outcome);
+}
+
+static int compare_mispredicts(const void *a, const void *b)
+{
+  const profile_entry *x = (const profile_entry *)a;
+  const profile_entry *y = (const profile_entry *)b;
+  if (x->mispredicts != y->mispredicts)
+  {
+    return (x->mispredicts < y->mispredicts) ? 1 : -1;
+  }
+  return (x->execs < y->execs) ? 1 : (x->execs > y->execs) ? -1 : 0;
+}
+
+void print_branch_profile(uint32_t mispredictions)
+{
+  // compact the occupied slots to the front of the table and sort them
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < profile_slots; i++)
+  {
+    if (profile_table[i].execs != 0)
+    {
+      profile_table[n++] = profile_table[i];
+    }
+  }
+  qsort(profile_table, n, sizeof(profile_entry), compare_mispredicts);
+
+  uint32_t shown = (profile_topN < n) ? profile_topN : n;
+  float total = (mispredictions != 0) ? (float)mispredictions : 1.0f;
+  float cumulative = 0;
+
+  printf("Static branches: %10d\n", n);
+  printf("Top %d branches by mispredictions:\n", shown);
+  printf("  %-14s %10s %10s %8s %8s %8s %8s%s\n",
+         "PC", "Execs", "Incorrect", "MissRate", "Taken", "Share", "Cumul",
+         (dict_size != 0) ? "  Branch" : "");
+  for (uint32_t i = 0; i < shown; i++)
+  {
+    profile_entry *entry = &profile_table[i];
+    float share = 100 * (float)entry->mispredicts / total;
+    cumulative += share;
+    printf("  0x%-12llx %10d %10d %7.3f%% %7.3f%% %7.3f%% %7.3f%%",
+           (unsigned long long)entry->pc, entry->execs, entry->mispredicts,
+           100 * (float)entry->mispredicts / (float)entry->execs,
+           100 * (float)entry->taken / (float)entry->execs,
+           share, cumulative);
+
+    // with a dictionary (--dict) the branch is shown by routine and disassembly
+    const dict_branch *branch = dict_branch_by_pc(entry->pc);
+    if (branch != NULL)
+    {
+      printf("  %s: %s", branch->routine, branch->disasm);
+    }
+    printf("\n");
+  }
+}
+
+void cleanup_branch_profile()
+{
+  free(profile_table);
+}
@@ -0,0 +1,44 @@
+//========================================================//
+//  branch_profile.h                                      //
+//  Header file for the per-branch misprediction profile  //
+//                                                        //
+//  Counts executions, mispredictions and taken outcomes  //
+//  of every static conditional branch, keyed by PC       //
+//========================================================//
+
+#ifndef BRANCH_PROFILE_H
+#define BRANCH_PROFILE_H
+
+#include <stdint.h>
+
+//------------------------------------//
+//      Branch Profile Defines        //
+//------------------------------------//
+
+// Number of branches printed when no count is given on the command line
+#define PROFILE_DEFAULT_TOPN 20
+
+// Initial number of hash table slots (must be a power of two)
+#define PROFILE_INIT_SLOTS (1 << 16)
+
+//------------------------------------//
+//  Branch Profile Function Prototypes//
+//------------------------------------//
+
+// Allocate the profile table, reporting the 'topN' worst branches at the end
+//
+void init_branch_profile(uint32_t topN);
+
+// Account one execution of the conditional branch at PC 'pc'
+//
+void profile_branch(uint64_t pc, uint32_t outcome, uint32_t prediction);
+
+// Print the 'topN' branches sorted by their misprediction contribution
+//
+void print_branch_profile(uint32_t mispredictions);
+
+// Free the profile table
+//
+void cleanup_branch_profile();
+
+#endif
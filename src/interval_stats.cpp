@@ -0,0 +1,196 @@
+//========================================================//
+//  interval_stats.cpp                                    //
+//  Source file for interval (time-series) statistics     //
+//                                                        //
+//  The simulation loop only fills a slot of a            //
+//  preallocated ring; a writer thread formats and writes //
+//========================================================//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "interval_stats.h"
+
+//------------------------------------//
+//    Interval Stats Data Structures  //
+//------------------------------------//
+
+typedef struct
+{
+  uint32_t start;          // cumulative conditional branches before the interval
+  uint32_t branches;       // conditional branches in the interval
+  uint32_t mispredictions; // mispredictions in the interval
+  uint64_t insts;          // instructions in the interval, 0 if unknown
+} interval_record;
+
+interval_record *interval_ring;
+uint64_t ring_head;        // records produced (written by the simulation loop)
+uint64_t ring_tail;        // records consumed (written by the writer thread)
+int ring_done;
+
+pthread_t writer_thread;
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ring_data = PTHREAD_COND_INITIALIZER;
+pthread_cond_t ring_space = PTHREAD_COND_INITIALIZER;
+
+FILE *interval_file;
+int interval_format;
+double insts_per_branch;   // from the sidecar, 0 if unknown
+
+uint32_t last_branches;
+uint32_t last_mispredictions;
+uint64_t last_insts;
+
+//------------------------------------//
+//      Interval Stats Functions      //
+//------------------------------------//
+
+int read_trace_info(const char *path, uint64_t *instructions, uint64_t *cond_branches)
+{
+  FILE *info = fopen(path, "r");
+  if (info == NULL)
+  {
+    return 0;
+  }
+
+  char line[256];
+  unsigned long long value;
+  *instructions = 0;
+  *cond_branches = 0;
+  while (fgets(line, sizeof(line), info) != NULL)
+  {
+    if (sscanf(line, "!!! Number of Instructions = %llu", &value) == 1)
+    {
+      *instructions = value;
+    }
+    else if (sscanf(line, "!!! Number of Conditional branches = %llu", &value) == 1)
+    {
+      *cond_branches = value;
+    }
+  }
+  fclose(info);
+
+  return *instructions != 0;
+}
+
+static void write_record(uint64_t index, interval_record *rec)
+{
+  double rate = 1000 * (double)rec->mispredictions / (double)rec->branches;
+  double insts = (rec->insts != 0) ? (double)rec->insts : insts_per_branch * rec->branches;
+  double mpki = (insts > 0) ? 1000 * (double)rec->mispredictions / insts : 0;
+
+  if (interval_format == INTERVAL_JSONL)
+  {
+    fprintf(interval_file,
+            "{\"interval\":%llu,\"start\":%u,\"branches\":%u,\"incorrect\":%u,"
+            "\"rate\":%.3f,\"instructions\":%.0f,\"mpki\":%.3f}\n",
+            (unsigned long long)index, rec->start, rec->branches, rec->mispredictions,
+            rate, insts, mpki);
+  }
+  else
+  {
+    fprintf(interval_file, "%llu,%u,%u,%u,%.3f,%.0f,%.3f\n",
+            (unsigned long long)index, rec->start, rec->branches, rec->mispredictions,
+            rate, insts, mpki);
+  }
+}
+
+static void *interval_writer(void *)
+{
+  pthread_mutex_lock(&ring_lock);
+  while (1)
+  {
+    while (ring_tail == ring_head && !ring_done)
+    {
+      pthread_cond_wait(&ring_data, &ring_lock);
+    }
+    if (ring_tail == ring_head)
+    {
+      break;
+    }
+
+    // format everything published so far without holding the lock
+    uint64_t head = ring_head;
+    pthread_mutex_unlock(&ring_lock);
+    for (uint64_t i = ring_tail; i < head; i++)
+    {
+      write_record(i, &interval_ring[i % INTERVAL_RING_SIZE]);
+    }
+    pthread_mutex_lock(&ring_lock);
+
+    ring_tail = head;
+    pthread_cond_signal(&ring_space);
+  }
+  pthread_mutex_unlock(&ring_lock);
+
+  return NULL;
+}
+
+int init_interval_stats(const char *path, int format, uint64_t instructions, uint64_t cond_branches)
+{
+  interval_file = fopen(path, "w");
+  if (interval_file == NULL)
+  {
+    return 0;
+  }
+
+  interval_format = format;
+  insts_per_branch = (cond_branches != 0) ? (double)instructions / (double)cond_branches : 0;
+  interval_ring = (interval_record *)malloc(INTERVAL_RING_SIZE * sizeof(interval_record));
+  ring_head = 0;
+  ring_tail = 0;
+  ring_done = 0;
+  last_branches = 0;
+  last_mispredictions = 0;
+  last_insts = 0;
+
+  if (format == INTERVAL_CSV)
+  {
+    fprintf(interval_file, "interval,start,branches,incorrect,rate,instructions,mpki\n");
+  }
+
+  pthread_create(&writer_thread, NULL, interval_writer, NULL);
+
+  return 1;
+}
+
+void record_interval(uint32_t branches, uint32_t mispredictions, uint64_t insts)
+{
+  pthread_mutex_lock(&ring_lock);
+  // only blocks if the writer is a whole ring behind
+  while (ring_head - ring_tail == INTERVAL_RING_SIZE)
+  {
+    pthread_cond_wait(&ring_space, &ring_lock);
+  }
+
+  interval_record *rec = &interval_ring[ring_head % INTERVAL_RING_SIZE];
+  rec->start = last_branches;
+  rec->branches = branches - last_branches;
+  rec->mispredictions = mispredictions - last_mispredictions;
+  rec->insts = insts - last_insts;
+  ring_head++;
+
+  pthread_cond_signal(&ring_data);
+  pthread_mutex_unlock(&ring_lock);
+
+  last_branches = branches;
+  last_mispredictions = mispredictions;
+  last_insts = insts;
+}
+
+void finish_interval_stats(uint32_t branches, uint32_t mispredictions, uint64_t insts)
+{
+  if (branches != last_branches)
+  {
+    record_interval(branches, mispredictions, insts);
+  }
+
+  pthread_mutex_lock(&ring_lock);
+  ring_done = 1;
+  pthread_cond_signal(&ring_data);
+  pthread_mutex_unlock(&ring_lock);
+
+  pthread_join(writer_thread, NULL);
+  fclose(interval_file);
+  free(interval_ring);
+}
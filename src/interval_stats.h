@@ -0,0 +1,55 @@
+//========================================================//
+//  interval_stats.h                                      //
+//  Header file for interval (time-series) statistics     //
+//                                                        //
+//  Misprediction counts per interval of N conditional    //
+//  branches, written as CSV or JSONL by a writer thread  //
+//========================================================//
+
+#ifndef INTERVAL_STATS_H
+#define INTERVAL_STATS_H
+
+#include <stdint.h>
+
+//------------------------------------//
+//      Interval Stats Defines        //
+//------------------------------------//
+
+// Output formats
+#define INTERVAL_CSV 0
+#define INTERVAL_JSONL 1
+
+// Number of preallocated interval records shared with the writer thread
+#define INTERVAL_RING_SIZE 4096
+
+//------------------------------------//
+//  Interval Stats Function Prototypes//
+//------------------------------------//
+
+// Read the instruction and conditional branch counts from a trace's
+// '.txt' sidecar ("!!! Number of Instructions = ...")
+//
+// Returns True if Successful
+//
+int read_trace_info(const char *path, uint64_t *instructions, uint64_t *cond_branches);
+
+// Open 'path' and start the writer thread. 'instructions' and
+// 'cond_branches' come from the sidecar and are used to estimate the
+// instructions of each interval (0 if unknown)
+//
+// Returns True if Successful
+//
+int init_interval_stats(const char *path, int format, uint64_t instructions, uint64_t cond_branches);
+
+// Close the interval ending at cumulative counts 'branches',
+// 'mispredictions' and 'insts'. 'insts' is the exact instruction count
+// of a version 2 binary trace; while it is 0 the sidecar estimate is
+// used. Never formats or writes on the caller's thread
+//
+void record_interval(uint32_t branches, uint32_t mispredictions, uint64_t insts);
+
+// Record the last partial interval, drain the writer and close the file
+//
+void finish_interval_stats(uint32_t branches, uint32_t mispredictions, uint64_t insts);
+
+#endif
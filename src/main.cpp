@@ -8,10 +8,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include "predictor.h"
+#include "branch_profile.h"
+#include "branch_dict.h"
+#include "shm_stream.h"
+#include "seek_stream.h"
+#include "interval_stats.h"
+#include "stage_timer.h"
+#include "trace_reader.h"
+#include "trace_format.h"
 
-FILE *stream;
-char *buf = NULL;
-size_t len = 0;
+int profileBranches = 0;  // Report the hardest-to-predict static branches
+uint32_t profileTopN = PROFILE_DEFAULT_TOPN;
+
+uint32_t intervalLength = 0;  // Conditional branches per reported interval, 0 = off
+int intervalFormat = INTERVAL_CSV;
+const char *intervalPath = NULL;
+const char *sidecarPath = NULL;  // trace '.txt' file with the instruction count
+const char *dictPath = NULL;     // static branch dictionary of the trace
+const char *shmName = NULL;      // read a live trace from this ring instead
+const char *tracePath = NULL;
+const char *indexPath = NULL;    // seek index of the trace
+uint64_t seekBranch = 0;         // branch records before the simulated ones
+uint64_t warmupBranches = 0;     // of those, only train the predictor
+
+int profileStages = 0;  // Time the stages of the main loop
+int profilePerf = 0;    // Also read the host hardware counters
 
 // Print out the Usage information to stderr
 //
@@ -19,9 +40,34 @@ void usage()
 {
   fprintf(stderr, "Usage: predictor <options> [<trace>]\n");
   fprintf(stderr, "       bunzip2 -kc trace.bz2 | predictor <options>\n");
+  fprintf(stderr, " Text and binary (branchExt default) traces are both accepted\n");
   fprintf(stderr, " Options:\n");
   fprintf(stderr, " --help       Print this message\n");
   fprintf(stderr, " --verbose    Print predictions on stdout\n");
+  fprintf(stderr, " --branch_profile[=N]\n"
+                  "              Print the N (default %d) static branches with\n"
+                  "              the most mispredictions\n", PROFILE_DEFAULT_TOPN);
+  fprintf(stderr, " --interval=N Report mispredictions every N conditional branches\n");
+  fprintf(stderr, " --interval_out=<file>\n"
+                  "              Interval output file (default intervals.csv)\n");
+  fprintf(stderr, " --jsonl      Write intervals as JSON lines instead of CSV\n");
+  fprintf(stderr, " --sidecar=<trace.txt>\n"
+                  "              Trace info file, used to compute MPKI\n");
+  fprintf(stderr, " --dict=<trace.dict>\n"
+                  "              Static branch dictionary, needed by compact\n"
+                  "              traces and shows --branch_profile symbolically\n");
+  fprintf(stderr, " --seek=N     Simulate from branch N of the trace on\n");
+  fprintf(stderr, " --warmup=N   With --seek, train on the N branches before it\n");
+  fprintf(stderr, " --index=<trace.idx>\n"
+                  "              Seek index (branchExt -index), so --seek starts\n"
+                  "              decoding at the block of the branch\n");
+  fprintf(stderr, " --shm=<name> Read the trace live from branchExt -shm <name>\n"
+                  "              through a shared-memory ring\n");
+  fprintf(stderr, " --profile    Print the time spent reading, parsing, predicting\n"
+                  "              and training per branch\n");
+  fprintf(stderr, " --profile_perf\n"
+                  "              --profile plus host cache and branch misses of\n"
+                  "              the predict/train stages (perf_event_open)\n");
   fprintf(stderr, " --<type>     Branch prediction scheme:\n");
   fprintf(stderr, "    static\n"
                   "    gshare\n"
@@ -56,28 +102,65 @@ int handle_option(char *arg)
   {
     verbose = 1;
   }
-  else
+  else if (!strcmp(arg, "--branch_profile"))
   {
-    return 0;
+    profileBranches = 1;
   }
-
-  return 1;
-}
-
-// Reads a line from the input stream and extracts the
-// PC and Outcome of a branch
-//
-// Returns True if Successful
-//
-int read_branch(uint32_t *pc, uint32_t *target, uint32_t *outcome, uint32_t *condition, uint32_t *call, uint32_t *ret, uint32_t *direct)
-{
-  if (getline(&buf, &len, stream) == -1)
+  else if (!strncmp(arg, "--branch_profile=", 17))
+  {
+    profileBranches = 1;
+    profileTopN = strtoul(arg + 17, NULL, 0);
+  }
+  else if (!strncmp(arg, "--interval=", 11))
+  {
+    intervalLength = strtoul(arg + 11, NULL, 0);
+  }
+  else if (!strncmp(arg, "--interval_out=", 15))
+  {
+    intervalPath = arg + 15;
+  }
+  else if (!strcmp(arg, "--jsonl"))
+  {
+    intervalFormat = INTERVAL_JSONL;
+  }
+  else if (!strncmp(arg, "--sidecar=", 10))
+  {
+    sidecarPath = arg + 10;
+  }
+  else if (!strncmp(arg, "--dict=", 7))
+  {
+    dictPath = arg + 7;
+  }
+  else if (!strncmp(arg, "--seek=", 7))
+  {
+    seekBranch = strtoull(arg + 7, NULL, 0);
+  }
+  else if (!strncmp(arg, "--warmup=", 9))
+  {
+    warmupBranches = strtoull(arg + 9, NULL, 0);
+  }
+  else if (!strncmp(arg, "--index=", 8))
+  {
+    indexPath = arg + 8;
+  }
+  else if (!strncmp(arg, "--shm=", 6))
+  {
+    shmName = arg + 6;
+  }
+  else if (!strcmp(arg, "--profile"))
+  {
+    profileStages = 1;
+  }
+  else if (!strcmp(arg, "--profile_perf"))
+  {
+    profileStages = 1;
+    profilePerf = 1;
+  }
+  else
   {
     return 0;
   }
 
-  sscanf(buf, "0x%x\t0x%x\t%d\t%d\t%d\t%d\t%d\n", pc, target, outcome, condition, call, ret, direct);
-
   return 1;
 }
 
@@ -108,26 +191,168 @@ int main(int argc, char *argv[])
     else
     {
       // Use as input file
+      tracePath = argv[i];
       stream = fopen(argv[i], "r");
     }
   }
 
+  if (dictPath != NULL && !load_branch_dict(dictPath))
+  {
+    fprintf(stderr, "Could not read the branch dictionary %s\n", dictPath);
+    exit(1);
+  }
+
+  if (shmName != NULL)
+  {
+    if (stream != stdin)
+    {
+      fprintf(stderr, "--shm reads the trace from the ring, not from a file\n");
+      exit(1);
+    }
+    stream = open_shm_stream(shmName, TRACE_SHM_DEFAULT_SIZE);
+    if (stream == NULL)
+    {
+      fprintf(stderr, "Could not create the shared memory ring %s\n", shmName);
+      exit(1);
+    }
+    fprintf(stderr, "Waiting for branchExt -shm %s\n", shmName);
+  }
+
+  // branch records of the trace before the first one read
+  uint64_t branch_ordinal = 0;
+  if (warmupBranches > seekBranch)
+  {
+    warmupBranches = seekBranch;
+  }
+  if (indexPath != NULL)
+  {
+    if (tracePath == NULL)
+    {
+      fprintf(stderr, "--index needs the trace file\n");
+      exit(1);
+    }
+    if (stream != NULL)
+    {
+      fclose(stream);
+    }
+    stream = open_seek_stream(tracePath, indexPath, seekBranch - warmupBranches, &branch_ordinal);
+    if (stream == NULL)
+    {
+      fprintf(stderr, "Could not read the trace or its index %s\n", indexPath);
+      exit(1);
+    }
+  }
+
+  if (stream == NULL || !open_trace())
+  {
+    fprintf(stderr, "Could not read the trace\n");
+    exit(1);
+  }
+
   // Initialize the predictor
   init_predictor();
+  if (profileBranches)
+  {
+    init_branch_profile(profileTopN);
+  }
+
+  uint64_t trace_insts = 0;
+  uint64_t trace_cond_branches = 0;
+  // The sidecar counts the whole trace
+  if (sidecarPath != NULL && seekBranch != 0)
+  {
+    fprintf(stderr, "Warning: --sidecar covers the whole trace and is ignored with --seek\n");
+    sidecarPath = NULL;
+  }
+  if (sidecarPath != NULL && !read_trace_info(sidecarPath, &trace_insts, &trace_cond_branches))
+  {
+    fprintf(stderr, "Could not read instruction count from %s\n", sidecarPath);
+    exit(1);
+  }
+
+  if (intervalLength != 0)
+  {
+    if (intervalPath == NULL)
+    {
+      intervalPath = (intervalFormat == INTERVAL_JSONL) ? "intervals.jsonl" : "intervals.csv";
+    }
+    if (!init_interval_stats(intervalPath, intervalFormat, trace_insts, trace_cond_branches))
+    {
+      fprintf(stderr, "Could not open %s\n", intervalPath);
+      exit(1);
+    }
+  }
 
   uint32_t num_branches = 0;
   uint32_t mispredictions = 0;
-  uint32_t pc = 0;
-  uint32_t target = 0;
+  uint64_t pc = 0;
+  uint64_t target = 0;
   uint32_t outcome = NOTTAKEN;
   uint32_t condition = 0;
   uint32_t call = 0;
   uint32_t ret = 0;
   uint32_t direct = 0;
+  uint32_t insts = 0;
+  uint64_t num_insts = 0;  // sum of the per-branch instruction counts
+  uint32_t next_interval = intervalLength;
+  uint64_t num_records = 0;
+  uint64_t num_simulated = 0;  // branches predicted or trained after --seek
+  uint64_t t[NUM_STAGES + 1];
+
+  if (profileStages)
+  {
+    init_stage_timer(profilePerf);
+  }
 
   // Reach each branch from the trace
-  while (read_branch(&pc, &target, &outcome, &condition, &call, &ret, &direct))
+  while (1)
   {
+    num_records++;
+    int sampled = profileStages && stage_tick();
+    if (sampled)
+    {
+      t[STAGE_READ] = stage_now();
+    }
+    if (!read_record())
+    {
+      break;
+    }
+    if (sampled)
+    {
+      t[STAGE_PARSE] = stage_now();
+    }
+    int is_branch = parse_branch(&pc, &target, &outcome, &condition, &call, &ret, &direct, &insts);
+    num_insts += insts;
+    if (!is_branch)
+    {
+      // instructions and call contexts of branchExt -predicated/-rep/-context
+      if (sampled)
+      {
+        stage_defer();
+      }
+      continue;
+    }
+    if (branch_ordinal++ < seekBranch)
+    {
+      // before --seek only the --warmup branches train the predictor
+      if (branch_ordinal > seekBranch - warmupBranches)
+      {
+        train_predictor(pc, target, outcome, condition, call, ret, direct);
+      }
+      num_insts = 0;
+      if (sampled)
+      {
+        stage_defer();
+      }
+      continue;
+    }
+    num_simulated++;
+    if (sampled)
+    {
+      stage_perf_begin();
+      t[STAGE_PREDICT] = stage_now();
+    }
+
     if (condition == 1)
     {
       num_branches++;
@@ -137,13 +362,37 @@ int main(int argc, char *argv[])
       {
         mispredictions++;
       }
+      if (profileBranches)
+      {
+        profile_branch(pc, outcome, prediction);
+      }
       if (verbose != 0)
       {
         printf("%d\n", prediction);
       }
+      if (num_branches == next_interval)
+      {
+        record_interval(num_branches, mispredictions, num_insts);
+        next_interval += intervalLength;
+      }
+    }
+    if (sampled)
+    {
+      t[STAGE_TRAIN] = stage_now();
     }
     // Train the predictor
     train_predictor(pc, target, outcome, condition, call, ret, direct);
+    if (sampled)
+    {
+      t[NUM_STAGES] = stage_now();
+      stage_perf_end();
+      stage_sample(t);
+    }
+  }
+
+  if (intervalLength != 0)
+  {
+    finish_interval_stats(num_branches, mispredictions, num_insts);
   }
 
   // Print out the mispredict statistics
@@ -151,10 +400,28 @@ int main(int argc, char *argv[])
   printf("Incorrect:       %10d\n", mispredictions);
   float mispredict_rate = 1000 * ((float)mispredictions / (float)num_branches);
   printf("Misprediction Rate: %7.3f\n", mispredict_rate);
+  if (trace_insts == 0)
+  {
+    trace_insts = num_insts;  // exact count from a version 2 binary trace
+  }
+  if (trace_insts != 0)
+  {
+    printf("Instructions:    %10llu\n", (unsigned long long)trace_insts);
+    printf("MPKI:               %7.3f\n", 1000 * (double)mispredictions / (double)trace_insts);
+  }
+  if (profileBranches)
+  {
+    print_branch_profile(mispredictions);
+    cleanup_branch_profile();
+  }
+  if (profileStages)
+  {
+    print_stage_timer(num_simulated, num_records - 1);
+  }
 
   // Cleanup
-  fclose(stream);
-  free(buf);
+  close_trace();
+  cleanup_branch_dict();
 
   return 0;
 }
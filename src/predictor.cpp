@@ -29,6 +29,11 @@ const char *bpName[4] = {"Static", "Gshare",
 int bpType;            // Branch Prediction Type
 int verbose;
 
+// call context, set by the simulator before every prediction
+uint64_t callFunction;
+uint64_t callContext;
+uint32_t callDepth;
+
 // gshare
 int ghistoryBits = 17; // Number of bits used for Global History (ghr of gshare)
 
@@ -85,7 +90,7 @@ void init_gshare() {
   ghistory = 0;
 }
 
-uint8_t gshare_predict(uint32_t pc) {
+uint8_t gshare_predict(uint64_t pc) {
   // this function returns the prediction result by accessing the BHT
   uint32_t bht_entries = 1 << ghistoryBits;         // bht_entries = 2^17
   uint32_t pc_lower_bits = pc & (bht_entries - 1);  // pc masking with 17 1s
@@ -107,7 +112,7 @@ uint8_t gshare_predict(uint32_t pc) {
   }
 }
 
-void train_gshare(uint32_t pc, uint8_t outcome) {
+void train_gshare(uint64_t pc, uint8_t outcome) {
   // this function updates the BHT entry based on the actual outcome
   uint32_t bht_entries = 1 << ghistoryBits;         // bht_entries = 2^17
   uint32_t pc_lower_bits = pc & (bht_entries - 1);  // pc masking with 17 1s
@@ -172,7 +177,7 @@ void init_tournament() {
   pathHistory = 0;
 }
 
-uint8_t tournament_predict(uint32_t pc) {
+uint8_t tournament_predict(uint64_t pc) {
   // this function returns the prediction result by choosing either local or global predictor
   uint32_t lht_entries = 1 << pcBits;           // lht_entries = 2^13
   uint32_t bht_entries = 1 << lhtBits;          // bht_entries = 2^15
@@ -198,7 +203,7 @@ uint8_t tournament_predict(uint32_t pc) {
   }
 }
 
-void train_tournament(uint32_t pc, uint8_t outcome) {
+void train_tournament(uint64_t pc, uint8_t outcome) {
   // this function updates tables based on the actual outcome
   uint32_t lht_entries = 1 << pcBits;           // lht_entries = 2^13
   uint32_t bht_entries = 1 << lhtBits;          // bht_entries = 2^15
@@ -321,9 +326,11 @@ void init_tage() {
     t4_table[i] = (1 << 14) | (1 << 13);  // initializes to 011 00000000000 00 = (3 counter | 11 tag | 3 useful)
   }
   ghr = 0;
+
+  init_gshare();                          // train_tage still updates the gshare BHT, so it has to exist
 }
 
-uint8_t tage_predict(uint32_t pc) {
+uint8_t tage_predict(uint64_t pc) {
   // this function returns the prediction result
 
   // indexing each table
@@ -384,7 +391,7 @@ uint8_t tage_predict(uint32_t pc) {
   }
 }
 
-void train_tage(uint32_t pc, uint8_t outcome) {
+void train_tage(uint64_t pc, uint8_t outcome) {
   // this function updates the BHT entry based on the actual outcome
   uint32_t bht_entries = 1 << ghistoryBits;         // bht_entries = 2^17
   uint32_t pc_lower_bits = pc & (bht_entries - 1);  // pc masking with 17 1s
@@ -420,6 +427,7 @@ void cleanup_tage()
   free(t2_table);
   free(t3_table);
   free(t4_table);
+  cleanup_gshare();
 }
 
 /*********************************************end of tage predictor functions **********************************************/
@@ -449,7 +457,7 @@ void init_predictor()
 // Returning TAKEN indicates a prediction of taken; returning NOTTAKEN
 // indicates a prediction of not taken
 //
-uint32_t make_prediction(uint32_t pc, uint32_t target, uint32_t direct)
+uint32_t make_prediction(uint64_t pc, uint64_t target, uint32_t direct)
 {
 
   // Make a prediction based on the bpType
@@ -476,7 +484,7 @@ uint32_t make_prediction(uint32_t pc, uint32_t target, uint32_t direct)
 // indicates that the branch was not taken)
 //
 
-void train_predictor(uint32_t pc, uint32_t target, uint32_t outcome, uint32_t condition, uint32_t call, uint32_t ret, uint32_t direct)
+void train_predictor(uint64_t pc, uint64_t target, uint32_t outcome, uint32_t condition, uint32_t call, uint32_t ret, uint32_t direct)
 {
   if (condition)
   {
@@ -495,3 +503,25 @@ void train_predictor(uint32_t pc, uint32_t target, uint32_t outcome, uint32_t co
     }
   }
 }
+
+// Free the tables allocated by init_predictor
+//
+void cleanup_predictor()
+{
+  switch (bpType)
+  {
+  case STATIC:
+    break;
+  case GSHARE:
+    cleanup_gshare();
+    break;
+  case TOURNAMENT:
+    cleanup_tournament();
+    break;
+  case CUSTOM:
+    cleanup_tage();
+    break;
+  default:
+    break;
+  }
+}
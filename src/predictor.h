@@ -70,17 +70,31 @@ void init_predictor();
 // Returning TAKEN indicates a prediction of taken; returning NOTTAKEN
 // indicates a prediction of not taken
 //
-uint32_t make_prediction(uint32_t pc, uint32_t target, uint32_t direct);
+uint32_t make_prediction(uint64_t pc, uint64_t target, uint32_t direct);
 
 // Train the predictor the last executed branch at PC 'pc' and with
 // outcome 'outcome' (true indicates that the branch was taken, false
 // indicates that the branch was not taken)
 //
-void train_predictor(uint32_t pc, uint32_t target, uint32_t outcome, uint32_t condition, uint32_t call, uint32_t ret, uint32_t direct);
+void train_predictor(uint64_t pc, uint64_t target, uint32_t outcome, uint32_t condition, uint32_t call, uint32_t ret, uint32_t direct);
 
 // Please add your code below, and DO NOT MODIFY ANY OF THE CODE ABOVE
 // 
 
+// Free the tables allocated by init_predictor
+//
+void cleanup_predictor();
+
+// Call context of the branch being predicted, from the context records of
+// a trace written with branchExt -context; 0 in other traces
+extern uint64_t callFunction; // entry of the current function
+extern uint64_t callContext;  // hash of the call path
+extern uint32_t callDepth;    // calls since the traced region started
+
+extern int pcBits;        // Number of bits used for PC lower bit (Tournament)
+extern int lhtBits;       // Number of bits used for Local History Table (Tournament)
+extern int phistoryBits;  // Number of bits used for Path History (Tournament)
+
 
 
 #endif
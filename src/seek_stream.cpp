@@ -0,0 +1,203 @@
+//========================================================//
+//  seek_stream.cpp                                       //
+//  Source file for the indexed trace reader              //
+//                                                        //
+//  A fopencookie stream over the header and the blocks   //
+//  of a trace from the one the index points to on        //
+//========================================================//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bzlib.h>
+#include "seek_stream.h"
+#include "trace_format.h"
+
+//------------------------------------//
+//   Indexed Trace Data Structures    //
+//------------------------------------//
+
+#define SEEK_READ_SIZE 65536
+
+typedef struct
+{
+  FILE *file;
+  uint64_t pos;         // in the file
+  uint64_t header_end;  // the header part of the file, read first
+  uint64_t block;       // where reading goes on after the header part
+  int compressed;
+  int decoding;         // inside a bz2 stream
+  bz_stream strm;
+  char in[SEEK_READ_SIZE];
+} seek_stream;
+
+//------------------------------------//
+//   Indexed Trace Functions          //
+//------------------------------------//
+
+// Reads the file as if the header part were followed by the block
+//
+static size_t seek_read_file(seek_stream *s, char *buf, size_t size)
+{
+  if (s->pos == s->header_end && s->pos != s->block)
+  {
+    fseek(s->file, s->block, SEEK_SET);
+    s->pos = s->block;
+  }
+  if (s->pos < s->header_end && size > s->header_end - s->pos)
+  {
+    size = s->header_end - s->pos;
+  }
+  size_t n = fread(buf, 1, size, s->file);
+  s->pos += n;
+  return n;
+}
+
+// Every block of a bz2 trace is a stream of its own, so a new one is
+// started at the end of each
+//
+static ssize_t seek_read(void *cookie, char *buf, size_t size)
+{
+  seek_stream *s = (seek_stream *)cookie;
+  if (!s->compressed)
+  {
+    return seek_read_file(s, buf, size);
+  }
+
+  s->strm.next_out = buf;
+  s->strm.avail_out = size;
+  while (s->strm.avail_out == size)
+  {
+    if (s->strm.avail_in == 0)
+    {
+      s->strm.avail_in = seek_read_file(s, s->in, SEEK_READ_SIZE);
+      s->strm.next_in = s->in;
+      if (s->strm.avail_in == 0)
+      {
+        break;
+      }
+    }
+    if (!s->decoding)
+    {
+      char *next_in = s->strm.next_in;
+      unsigned int avail_in = s->strm.avail_in;
+      if (BZ2_bzDecompressInit(&s->strm, 0, 0) != BZ_OK)
+      {
+        return -1;
+      }
+      s->strm.next_in = next_in;
+      s->strm.avail_in = avail_in;
+      s->decoding = 1;
+    }
+
+    int ret = BZ2_bzDecompress(&s->strm);
+    if (ret == BZ_STREAM_END)
+    {
+      BZ2_bzDecompressEnd(&s->strm);
+      s->decoding = 0;
+    }
+    else if (ret != BZ_OK)
+    {
+      return -1;
+    }
+  }
+  return size - s->strm.avail_out;
+}
+
+static int seek_close(void *cookie)
+{
+  seek_stream *s = (seek_stream *)cookie;
+  if (s->decoding)
+  {
+    BZ2_bzDecompressEnd(&s->strm);
+  }
+  fclose(s->file);
+  free(s);
+  return 0;
+}
+
+// Finds the block of 'branch' in the index. 'header_end' is set to the
+// start of the first block, 'block' to the start of the one found
+//
+// Returns True if Successful
+//
+static int find_block(const char *index, uint64_t branch, uint64_t *header_end, uint64_t *block, uint64_t *first)
+{
+  FILE *f = fopen(index, "r");
+  if (f == NULL)
+  {
+    return 0;
+  }
+  trace_header header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != TRACE_MAGIC ||
+      header.version != TRACE_VERSION_INDEX || header.record_size != sizeof(trace_index_entry))
+  {
+    fclose(f);
+    return 0;
+  }
+
+  // the entries are in file order, so also in branch order
+  fseek(f, 0, SEEK_END);
+  long entries = (ftell(f) - sizeof(header)) / sizeof(trace_index_entry);
+  long lo = 0;
+  long hi = entries;
+  trace_index_entry entry;
+  while (hi - lo > 1)
+  {
+    long mid = (lo + hi) / 2;
+    fseek(f, sizeof(header) + mid * sizeof(entry), SEEK_SET);
+    if (fread(&entry, sizeof(entry), 1, f) != 1)
+    {
+      break;
+    }
+    if (entry.branch <= branch)
+    {
+      lo = mid;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  *header_end = 0;
+  *block = 0;
+  *first = 0;
+  fseek(f, sizeof(header), SEEK_SET);
+  if (entries > 0 && fread(&entry, sizeof(entry), 1, f) == 1)
+  {
+    *header_end = entry.offset;
+    fseek(f, sizeof(header) + lo * sizeof(entry), SEEK_SET);
+    if (fread(&entry, sizeof(entry), 1, f) == 1)
+    {
+      *block = entry.offset;
+      *first = entry.branch;
+    }
+  }
+  fclose(f);
+  return 1;
+}
+
+FILE *open_seek_stream(const char *trace, const char *index, uint64_t branch, uint64_t *first)
+{
+  uint64_t header_end, block;
+  if (!find_block(index, branch, &header_end, &block, first))
+  {
+    return NULL;
+  }
+  FILE *file = fopen(trace, "r");
+  if (file == NULL)
+  {
+    return NULL;
+  }
+
+  seek_stream *s = (seek_stream *)calloc(1, sizeof(seek_stream));
+  s->file = file;
+  s->header_end = header_end;
+  s->block = block;
+  char magic[3];
+  s->compressed = fread(magic, 1, 3, file) == 3 && !memcmp(magic, "BZh", 3);
+  rewind(file);
+
+  cookie_io_functions_t io = {seek_read, NULL, NULL, seek_close};
+  return fopencookie(s, "r", io);
+}
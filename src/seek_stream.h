@@ -0,0 +1,29 @@
+//========================================================//
+//  seek_stream.h                                         //
+//  Header file for the indexed trace reader              //
+//                                                        //
+//  Opens a branchExt trace in the middle, at the block   //
+//  its seek index (branchExt -index) gives for a branch  //
+//========================================================//
+
+#ifndef SEEK_STREAM_H
+#define SEEK_STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+//------------------------------------//
+//  Indexed Trace Function Prototypes //
+//------------------------------------//
+
+// Open the trace file 'trace' (.bz2 or not) at the last block of the
+// index 'index' that starts at or before branch record 'branch'. The
+// stream returns the trace header, if the trace has one, then the trace
+// from that block on, decompressed. 'first' is set to the branch records
+// in front of the block
+//
+// Returns NULL if the files could not be read
+//
+FILE *open_seek_stream(const char *trace, const char *index, uint64_t branch, uint64_t *first);
+
+#endif
@@ -0,0 +1,134 @@
+//========================================================//
+//  shm_stream.cpp                                        //
+//  Source file for the live trace reader                 //
+//                                                        //
+//  A fopencookie stream over the consumer side of the    //
+//  ring; closing it removes the shared memory object     //
+//========================================================//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "shm_stream.h"
+#include "trace_shm.h"
+
+//------------------------------------//
+//    Live Trace Data Structures      //
+//------------------------------------//
+
+// Polls before the reader starts sleeping on an empty ring
+#define SHM_SPIN 1000
+#define SHM_SLEEP_US 50
+
+typedef struct
+{
+  trace_shm_header *ring;
+  char *data;
+  size_t length;  // of the mapping
+  char *name;
+} shm_stream;
+
+//------------------------------------//
+//      Live Trace Functions          //
+//------------------------------------//
+
+static ssize_t shm_read(void *cookie, char *buf, size_t size)
+{
+  shm_stream *s = (shm_stream *)cookie;
+  trace_shm_header *ring = s->ring;
+  uint64_t tail = ring->tail;
+  uint64_t head;
+
+  // wait for data, or the end of the trace
+  for (uint32_t i = 0;; i++)
+  {
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head != tail)
+    {
+      break;
+    }
+    if (__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE))
+    {
+      // head may have moved before done was set
+      head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      if (head == tail)
+      {
+        return 0;
+      }
+      break;
+    }
+    if (i >= SHM_SPIN)
+    {
+      usleep(SHM_SLEEP_US);
+    }
+  }
+
+  // up to the end of the data area, the next read takes the wrapped part
+  uint64_t offset = tail & (ring->size - 1);
+  uint64_t n = head - tail;
+  if (n > size)
+  {
+    n = size;
+  }
+  if (n > ring->size - offset)
+  {
+    n = ring->size - offset;
+  }
+  memcpy(buf, s->data + offset, n);
+  __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+
+  return n;
+}
+
+static int shm_close(void *cookie)
+{
+  shm_stream *s = (shm_stream *)cookie;
+  munmap(s->ring, s->length);
+  shm_unlink(s->name);
+  free(s->name);
+  free(s);
+  return 0;
+}
+
+FILE *open_shm_stream(const char *name, uint64_t size)
+{
+  char path[256];
+  snprintf(path, sizeof(path), "/%s", name);
+
+  // a ring left behind by an earlier run is replaced
+  shm_unlink(path);
+  int fd = shm_open(path, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+  size_t length = sizeof(trace_shm_header) + size;
+  if (ftruncate(fd, length) != 0)
+  {
+    close(fd);
+    shm_unlink(path);
+    return NULL;
+  }
+  void *mem = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+  {
+    shm_unlink(path);
+    return NULL;
+  }
+
+  shm_stream *s = (shm_stream *)malloc(sizeof(shm_stream));
+  s->ring = (trace_shm_header *)mem;
+  s->data = (char *)mem + sizeof(trace_shm_header);
+  s->length = length;
+  s->name = strdup(path);
+
+  // the object is zero filled; publishing the magic makes it usable
+  s->ring->size = size;
+  __atomic_store_n(&s->ring->magic, TRACE_SHM_MAGIC, __ATOMIC_RELEASE);
+
+  cookie_io_functions_t io = {shm_read, NULL, NULL, shm_close};
+  return fopencookie(s, "r", io);
+}
@@ -0,0 +1,28 @@
+//========================================================//
+//  shm_stream.h                                          //
+//  Header file for the live trace reader                 //
+//                                                        //
+//  Exposes the shared-memory ring of trace_shm.h as a    //
+//  stdio stream, so the simulator reads it like a file   //
+//========================================================//
+
+#ifndef SHM_STREAM_H
+#define SHM_STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "trace_shm.h"
+
+//------------------------------------//
+//   Live Trace Function Prototypes   //
+//------------------------------------//
+
+// Create the ring 'name' with 'size' bytes of data and return a stream
+// reading from it. Reads block until branchExt writes more of the trace
+// and return end of file once it is done
+//
+// Returns NULL if the ring could not be created
+//
+FILE *open_shm_stream(const char *name, uint64_t size);
+
+#endif
@@ -0,0 +1,175 @@
+//========================================================//
+//  stage_timer.cpp                                       //
+//  Source file for the simulator phase profiler          //
+//                                                        //
+//  Sampled clock_gettime timing of the main loop stages  //
+//  and optional Linux perf_event_open counters           //
+//========================================================//
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "stage_timer.h"
+
+//------------------------------------//
+//     Stage Timer Data Structures    //
+//------------------------------------//
+
+const char *stageName[NUM_STAGES] = {"Read", "Parse", "Predict", "Train"};
+
+uint64_t stage_ns[NUM_STAGES];  // time spent in each stage by the sampled branches
+uint64_t stage_samples;
+uint64_t stage_start;           // start of the whole run
+uint32_t stage_countdown;
+uint32_t stage_rng = 0x2545f491;  // xorshift state for the sample gaps
+
+// Hardware counters, read as one group
+#define NUM_PERF_COUNTERS 2
+const char *perfName[NUM_PERF_COUNTERS] = {"Host cache misses", "Host branch misses"};
+uint64_t perfConfig[NUM_PERF_COUNTERS] = {PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+int perf_fd = -1;               // group leader, -1 when perf is not used
+uint64_t perf_before[NUM_PERF_COUNTERS + 1];
+int perf_before_valid;          // the read in stage_perf_begin succeeded
+uint64_t perf_total[NUM_PERF_COUNTERS];
+uint64_t perf_samples;          // samples with both reads, counted in perf_total
+
+//------------------------------------//
+//       Stage Timer Functions        //
+//------------------------------------//
+
+static void next_sample()
+{
+  stage_rng ^= stage_rng << 13;
+  stage_rng ^= stage_rng >> 17;
+  stage_rng ^= stage_rng << 5;
+  // uniform in [1, 2^(STAGE_SAMPLE_SHIFT+1) - 1], mean 2^STAGE_SAMPLE_SHIFT
+  stage_countdown = 1 + stage_rng % ((2u << STAGE_SAMPLE_SHIFT) - 1);
+}
+
+static int open_counter(uint64_t config, int group_fd)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.disabled = (group_fd == -1);
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+void init_stage_timer(int use_perf)
+{
+  memset(stage_ns, 0, sizeof(stage_ns));
+  memset(perf_total, 0, sizeof(perf_total));
+  perf_samples = 0;
+  stage_samples = 0;
+  next_sample();
+
+  if (use_perf)
+  {
+    perf_fd = open_counter(perfConfig[0], -1);
+    for (int i = 1; i < NUM_PERF_COUNTERS && perf_fd != -1; i++)
+    {
+      if (open_counter(perfConfig[i], perf_fd) == -1)
+      {
+        close(perf_fd);
+        perf_fd = -1;
+      }
+    }
+    if (perf_fd == -1)
+    {
+      fprintf(stderr, "Warning: perf_event_open failed, hardware counters disabled\n");
+    }
+    else
+    {
+      ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+  }
+
+  stage_start = stage_now();
+}
+
+void stage_sample(const uint64_t *t)
+{
+  for (int i = 0; i < NUM_STAGES; i++)
+  {
+    stage_ns[i] += t[i + 1] - t[i];
+  }
+  stage_samples++;
+  next_sample();
+}
+
+void stage_perf_begin()
+{
+  if (perf_fd != -1)
+  {
+    perf_before_valid = read(perf_fd, perf_before, sizeof(perf_before)) == sizeof(perf_before);
+  }
+}
+
+void stage_perf_end()
+{
+  // a failed or short read leaves the sample out
+  if (perf_fd != -1 && perf_before_valid)
+  {
+    uint64_t after[NUM_PERF_COUNTERS + 1];
+    if (read(perf_fd, after, sizeof(after)) == sizeof(after))
+    {
+      // after[0] is the number of counters in the group
+      for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+      {
+        perf_total[i] += after[i + 1] - perf_before[i + 1];
+      }
+      perf_samples++;
+    }
+  }
+}
+
+void print_stage_timer(uint64_t branches, uint64_t records)
+{
+  uint64_t wall = stage_now() - stage_start;
+  if (stage_samples == 0 || branches == 0)
+  {
+    return;
+  }
+
+  printf("Profile (%llu of %llu simulated branches sampled, %llu records read):\n",
+         (unsigned long long)stage_samples, (unsigned long long)branches, (unsigned long long)records);
+  printf("  %-10s %10s %14s %8s\n", "Stage", "ns/branch", "branches/s", "Share");
+
+  double staged = 0;
+  for (int i = 0; i < NUM_STAGES; i++)
+  {
+    staged += (double)stage_ns[i] / (double)stage_samples;
+  }
+
+  // shares are relative to the sampled stages, which include the cost of
+  // the timer itself; the total below is the unsampled wall time, records
+  // that are not simulated included, per simulated branch
+  for (int i = 0; i < NUM_STAGES; i++)
+  {
+    double ns = (double)stage_ns[i] / (double)stage_samples;
+    printf("  %-10s %10.1f %14.0f %7.2f%%\n", stageName[i], ns,
+           (ns > 0) ? 1e9 / ns : 0, 100 * ns / staged);
+  }
+
+  double total = (double)wall / (double)branches;
+  printf("  %-10s %10.1f %14.0f\n", "Total", total, 1e9 / total);
+
+  if (perf_fd != -1)
+  {
+    printf("Predict+train hardware counters per branch:\n");
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+    {
+      printf("  %-20s %10.4f\n", perfName[i], (perf_samples > 0) ? (double)perf_total[i] / (double)perf_samples : 0.0);
+    }
+    close(perf_fd);
+  }
+}
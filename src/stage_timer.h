@@ -0,0 +1,85 @@
+//========================================================//
+//  stage_timer.h                                         //
+//  Header file for the simulator phase profiler          //
+//                                                        //
+//  Times the read/parse/predict/train stages of the main //
+//  loop on a sample of the branches (--profile)          //
+//========================================================//
+
+#ifndef STAGE_TIMER_H
+#define STAGE_TIMER_H
+
+#include <stdint.h>
+#include <time.h>
+
+//------------------------------------//
+//       Stage Timer Defines          //
+//------------------------------------//
+
+// On average one branch out of every 2^STAGE_SAMPLE_SHIFT is timed. The
+// gap between samples is random so it cannot alias with periodic events
+// like stdio buffer refills
+#define STAGE_SAMPLE_SHIFT 6
+
+// The stages of the main loop, in the order they run
+#define STAGE_READ 0     // getline/fread: I/O, includes waiting on bunzip2
+#define STAGE_PARSE 1    // decoding of the trace line or record
+#define STAGE_PREDICT 2  // make_prediction and statistics
+#define STAGE_TRAIN 3    // train_predictor
+#define NUM_STAGES 4
+
+extern uint32_t stage_countdown;  // branches left until the next sample
+
+//------------------------------------//
+//   Stage Timer Function Prototypes  //
+//------------------------------------//
+
+// Returns True if the current branch should be timed
+//
+static inline int stage_tick()
+{
+  return --stage_countdown == 0;
+}
+
+// The branch due to be timed is not simulated; the next one is timed
+// instead. A sample that is neither taken nor moved on would stop the
+// sampling
+//
+static inline void stage_defer()
+{
+  stage_countdown = 1;
+}
+
+// Current time in nanoseconds
+//
+static inline uint64_t stage_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Start profiling. With 'use_perf' the host cache misses and branch
+// mispredictions of the predict/train stages are also counted
+//
+void init_stage_timer(int use_perf);
+
+// Account one sampled branch. 't' holds NUM_STAGES + 1 timestamps,
+// taken before the first stage and after each stage
+//
+void stage_sample(const uint64_t *t);
+
+// Start and stop the hardware counters around the predict/train stages
+// of a sampled branch
+//
+void stage_perf_begin();
+void stage_perf_end();
+
+// Print ns/branch and branches/s for every stage. Only the 'branches'
+// simulated are sampled and count for the total, out of the 'records'
+// read, which also include the records that are not branches and the
+// branches before --seek
+//
+void print_stage_timer(uint64_t branches, uint64_t records);
+
+#endif
@@ -0,0 +1,149 @@
+//========================================================//
+//  trace_format.h                                        //
+//  Binary branch trace format                            //
+//                                                        //
+//  Shared by branchExt, which writes it, and the         //
+//  simulator, which reads it next to the text format     //
+//========================================================//
+
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+#include <stdint.h>
+
+//------------------------------------//
+//       Trace Format Defines         //
+//------------------------------------//
+
+// A binary trace starts with a trace_header. Text traces always start
+// with "0x", so the first byte tells the two formats apart
+#define TRACE_MAGIC 0x54504242  // "BBPT" in little endian
+#define TRACE_VERSION 2
+#define TRACE_VERSION_V1 1  // 32-bit addresses, still accepted by the simulator
+#define TRACE_VERSION_COMPACT 3  // branch ids, needs the static branch dictionary
+#define TRACE_VERSION_LOADS 4  // side stream of loads, not a trace
+#define TRACE_VERSION_INDEX 5  // seek index of a trace, not a trace
+
+// Bits of trace_record.flags, in the order of the text columns
+#define TRACE_TAKEN (1 << 0)
+#define TRACE_COND (1 << 1)
+#define TRACE_CALL (1 << 2)
+#define TRACE_RET (1 << 3)
+#define TRACE_DIRECT (1 << 4)
+
+// Records that are not branches, only written with branchExt -predicated,
+// -rep and -context. In text traces they have an eighth column, the kind
+// (flags & TRACE_NOT_BRANCH) >> TRACE_KIND_SHIFT, that branch lines do not
+// have. The simulator does not predict them
+#define TRACE_PREDICATED (1 << 5)  // CMOVcc or SETcc, TRACE_TAKEN when the
+                                   // condition holds; the target is 0
+#define TRACE_REP (1 << 6)         // REP string instruction, the target is the
+                                   // count register before the first iteration:
+                                   // the iterations of MOVS/STOS/LODS/INS/OUTS,
+                                   // their upper bound for CMPS/SCAS
+#define TRACE_CONTEXT (1 << 7)     // call context of the following branches:
+                                   // the pc is the entry of the current
+                                   // function, the target the call path hash
+#define TRACE_KIND_SHIFT 5
+#define TRACE_NOT_BRANCH (TRACE_PREDICATED | TRACE_REP | TRACE_CONTEXT)
+
+// Call depth of a TRACE_CONTEXT record, in the flags above this shift. A
+// text line has it in a ninth column
+#define TRACE_DEPTH_SHIFT 16
+
+//------------------------------------//
+//       Trace Format Structures      //
+//------------------------------------//
+
+typedef struct
+{
+  uint32_t magic;        // TRACE_MAGIC
+  uint32_t version;      // TRACE_VERSION
+  uint32_t record_size;  // sizeof(trace_record)
+  uint32_t reserved;
+} trace_header;
+
+// One branch, the same information as one line of a text trace plus
+// the instruction count since the previous branch
+typedef struct
+{
+  uint64_t pc;
+  uint64_t target;
+  uint32_t flags;
+  uint16_t insts;     // instructions since the previous record, this branch
+                      // included; saturates at 0xffff
+  uint8_t length;     // size of the branch instruction in bytes
+  uint8_t reserved;
+} trace_record;
+
+// Version 3 record. The PC, class, direct target and length of the branch
+// are in the static branch dictionary; an indirect branch (no
+// TRACE_DIRECT) is followed by its 64-bit target, a TRACE_REP record by
+// its count. A TRACE_CONTEXT record has the id TRACE_CONTEXT_ID, the depth
+// in place of the instruction count and is followed by the function entry
+// and the call path hash
+typedef struct
+{
+  uint32_t branch;    // dictionary id << 1 | taken
+  uint16_t insts;     // as in trace_record
+  uint16_t reserved;
+} trace_compact_record;
+
+#define TRACE_CONTEXT_ID 0x7fffffff
+#define TRACE_HAS_TARGET(flags) (!((flags) & (TRACE_DIRECT | TRACE_PREDICATED)))
+
+// Side stream written next to the trace by branchExt -loads, a
+// trace_header with TRACE_VERSION_LOADS and one record per load. Each
+// conditional branch is preceded by the loads of its basic block that its
+// condition depends on, oldest first
+typedef struct
+{
+  uint64_t record;    // index of the branch the load feeds among the branch
+                      // records of the trace, not counting TRACE_NOT_BRANCH
+  uint64_t pc;        // of the load
+  uint64_t addr;      // effective address
+  uint64_t value;     // the first 8 bytes read, 0 without -load_values
+  uint32_t size;      // bytes read
+  uint32_t reserved;
+} trace_load_record;
+
+// Seek index written next to the trace by branchExt -index, a
+// trace_header with TRACE_VERSION_INDEX and one entry per block of the
+// trace, in file order. Every block starts at a record and, with -compress
+// bz2, is a bz2 stream of its own, so decoding can start at any of them.
+// The bytes in front of the first block hold the trace_header (a bz2
+// stream of its own too)
+typedef struct
+{
+  uint64_t branch;    // branch records in front of the block, counted as
+                      // trace_load_record.record
+  uint64_t insts;     // instructions of the trace in front of the block
+  uint64_t offset;    // of the block in the trace file
+  uint64_t data;      // of the block in the decompressed trace
+} trace_index_entry;
+
+// Version 1 record, addresses truncated to 32 bits
+typedef struct
+{
+  uint32_t pc;
+  uint32_t target;
+  uint32_t flags;
+} trace_record_v1;
+
+//------------------------------------//
+//     Static Branch Dictionary       //
+//------------------------------------//
+
+// The dictionary is a text file written by branchExt at exit. After a
+// "#" comment line, every static branch has one line of tab separated
+// columns:
+//
+//   id  pc  flags  class  length  target  fallthrough  image  routine  disassembly
+//
+// pc, flags, target and fallthrough are hex with a 0x prefix; flags are
+// the TRACE_* bits without TRACE_TAKEN and target is 0 for indirect
+// branches and the instructions that are not branches. Their class is
+// "predicated" or "rep". Unknown images and routines are written as "?"
+#define DICT_COLUMNS 10
+
+#endif
@@ -0,0 +1,205 @@
+//========================================================//
+//  trace_reader.cpp                                      //
+//  Source file for the trace reader                      //
+//                                                        //
+//  Reads text and binary (trace_format.h) traces record  //
+//  by record, for the simulator and the benchmark        //
+//========================================================//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "predictor.h"
+#include "branch_dict.h"
+#include "trace_reader.h"
+#include "trace_format.h"
+
+//------------------------------------//
+//      Trace Reader Data             //
+//------------------------------------//
+
+FILE *stream;
+char *buf = NULL;
+size_t len = 0;
+
+// Binary traces are read in batches of records
+#define RECORD_BATCH 4096
+int binaryTrace = 0;      // version of the binary trace, 0 for text
+char *records = NULL;
+size_t recordSize = 0;
+size_t recordCount = 0;
+size_t recordPos = 0;
+
+//------------------------------------//
+//      Trace Reader Functions        //
+//------------------------------------//
+
+int open_trace()
+{
+  int c = getc(stream);
+  if (c == EOF)
+  {
+    return 1;
+  }
+  ungetc(c, stream);
+  if (c == '0')
+  {
+    return 1;  // text trace
+  }
+
+  trace_header header;
+  if (fread(&header, sizeof(header), 1, stream) != 1 || header.magic != TRACE_MAGIC)
+  {
+    return 0;
+  }
+  if (header.version == TRACE_VERSION && header.record_size == sizeof(trace_record))
+  {
+    recordSize = sizeof(trace_record);
+  }
+  else if (header.version == TRACE_VERSION_COMPACT && header.record_size == sizeof(trace_compact_record))
+  {
+    if (dict_size == 0)
+    {
+      fprintf(stderr, "Compact traces need the branch dictionary (--dict)\n");
+      return 0;
+    }
+    recordSize = sizeof(trace_compact_record);
+  }
+  else if (header.version == TRACE_VERSION_V1 && header.record_size == sizeof(trace_record_v1))
+  {
+    recordSize = sizeof(trace_record_v1);
+  }
+  else
+  {
+    return 0;
+  }
+  binaryTrace = header.version;
+  records = (char *)malloc(RECORD_BATCH * recordSize);
+
+  return 1;
+}
+
+// Returns the next record of a binary trace, NULL at the end
+//
+static char *next_record()
+{
+  if (recordPos == recordCount)
+  {
+    recordCount = fread(records, recordSize, RECORD_BATCH, stream);
+    recordPos = 0;
+    if (recordCount == 0)
+    {
+      return NULL;
+    }
+  }
+  return records + recordPos++ * recordSize;
+}
+
+int read_record()
+{
+  if (binaryTrace)
+  {
+    return next_record() != NULL;
+  }
+
+  return getline(&buf, &len, stream) != -1;
+}
+
+int parse_branch(uint64_t *pc, uint64_t *target, uint32_t *outcome, uint32_t *condition, uint32_t *call, uint32_t *ret, uint32_t *direct, uint32_t *insts)
+{
+  if (binaryTrace)
+  {
+    char *raw = records + (recordPos - 1) * recordSize;
+    uint32_t flags;
+    if (binaryTrace == TRACE_VERSION_COMPACT)
+    {
+      trace_compact_record *rec = (trace_compact_record *)raw;
+      if ((rec->branch >> 1) == TRACE_CONTEXT_ID)
+      {
+        // the function and the hash take the place of the next two records
+        callDepth = rec->insts;
+        char *next = next_record();
+        callFunction = (next != NULL) ? *(uint64_t *)next : 0;
+        next = next_record();
+        callContext = (next != NULL) ? *(uint64_t *)next : 0;
+        *insts = 0;
+        return 0;
+      }
+      const dict_branch *branch = dict_branch_by_id(rec->branch >> 1);
+      if (branch == NULL)
+      {
+        fprintf(stderr, "Branch %u is not in the dictionary\n", rec->branch >> 1);
+        exit(1);
+      }
+      *pc = branch->pc;
+      *target = branch->target;
+      *insts = rec->insts;
+      flags = branch->flags | ((rec->branch & 1) ? TRACE_TAKEN : 0);
+      if (TRACE_HAS_TARGET(flags))
+      {
+        // the target takes the place of the next record
+        char *next = next_record();
+        *target = (next != NULL) ? *(uint64_t *)next : 0;
+      }
+    }
+    else if (binaryTrace == TRACE_VERSION)
+    {
+      trace_record *rec = (trace_record *)raw;
+      *pc = rec->pc;
+      *target = rec->target;
+      *insts = rec->insts;
+      flags = rec->flags;
+    }
+    else
+    {
+      trace_record_v1 *rec = (trace_record_v1 *)raw;
+      *pc = rec->pc;
+      *target = rec->target;
+      *insts = 0;
+      flags = rec->flags;
+    }
+    *outcome = (flags & TRACE_TAKEN) != 0;
+    *condition = (flags & TRACE_COND) != 0;
+    *call = (flags & TRACE_CALL) != 0;
+    *ret = (flags & TRACE_RET) != 0;
+    *direct = (flags & TRACE_DIRECT) != 0;
+    if (flags & TRACE_CONTEXT)
+    {
+      callFunction = *pc;
+      callContext = *target;
+      callDepth = flags >> TRACE_DEPTH_SHIFT;
+    }
+    return !(flags & TRACE_NOT_BRANCH);
+  }
+
+  unsigned long long text_pc, text_target;
+  uint32_t kind = 0;
+  uint32_t depth = 0;
+  sscanf(buf, "0x%llx\t0x%llx\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", &text_pc, &text_target, outcome, condition, call, ret, direct, &kind, &depth);
+  *pc = text_pc;
+  *target = text_target;
+  *insts = 0;
+  if (kind == (TRACE_CONTEXT >> TRACE_KIND_SHIFT))
+  {
+    callFunction = *pc;
+    callContext = *target;
+    callDepth = depth;
+  }
+  return kind == 0;
+}
+
+void close_trace()
+{
+  if (stream != NULL)
+  {
+    fclose(stream);
+    stream = NULL;
+  }
+  free(buf);
+  free(records);
+  buf = NULL;
+  len = 0;
+  records = NULL;
+  binaryTrace = 0;
+  recordCount = 0;
+  recordPos = 0;
+}
@@ -0,0 +1,48 @@
+//========================================================//
+//  trace_reader.h                                        //
+//  Header file for the trace reader                      //
+//                                                        //
+//  Decodes the text and binary traces of branchExt for   //
+//  the simulator and the benchmark                       //
+//========================================================//
+
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// The trace is read from 'stream'. It is set before open_trace: a file, a
+// pipe from bunzip2, or the streams of shm_stream.h and seek_stream.h
+extern FILE *stream;
+
+//------------------------------------//
+//   Trace Reader Function Prototypes //
+//------------------------------------//
+
+// Detects whether the input is a binary trace (see trace_format.h)
+// and consumes its header. Compact traces need the branch dictionary
+// to be loaded first
+//
+// Returns True if Successful
+//
+int open_trace();
+
+// Reads the next branch from the input stream
+//
+// Returns True if Successful
+//
+int read_record();
+
+// Extracts the PC and Outcome of the last branch read. 'insts' is the
+// number of instructions since the previous branch, 0 if the trace
+// does not record it. Returns False for a record that is not a branch
+// (TRACE_NOT_BRANCH); a context record sets the call context instead
+//
+int parse_branch(uint64_t *pc, uint64_t *target, uint32_t *outcome, uint32_t *condition, uint32_t *call, uint32_t *ret, uint32_t *direct, uint32_t *insts);
+
+// Close the stream and free the buffers
+//
+void close_trace();
+
+#endif
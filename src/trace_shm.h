@@ -0,0 +1,46 @@
+//========================================================//
+//  trace_shm.h                                           //
+//  Shared-memory ring for live traces                    //
+//                                                        //
+//  The simulator creates the ring (--shm) and reads from //
+//  it while branchExt (-shm) writes the trace into it    //
+//========================================================//
+
+#ifndef TRACE_SHM_H
+#define TRACE_SHM_H
+
+#include <stdint.h>
+
+//------------------------------------//
+//        Trace Ring Defines          //
+//------------------------------------//
+
+// The ring is the POSIX shared memory object TRACE_SHM_DIR<name>. It
+// carries the bytes of an uncompressed trace file, header included
+#define TRACE_SHM_DIR "/dev/shm/"
+#define TRACE_SHM_MAGIC 0x4d485342  // "BSHM" in little endian
+#define TRACE_SHM_DEFAULT_SIZE (64 << 20)
+
+//------------------------------------//
+//       Trace Ring Structures        //
+//------------------------------------//
+
+// Start of the shared memory object, followed by 'size' bytes of data.
+// 'head' and 'tail' only grow and are accessed with acquire/release
+// atomics; each side waits while the ring is full (branchExt) or empty
+// (simulator), so no record is ever dropped. They are on cache lines of
+// their own so the two processes do not invalidate each other's line
+typedef struct
+{
+  uint32_t magic;     // TRACE_SHM_MAGIC, set by the simulator once ready
+  uint32_t reserved;
+  uint64_t size;      // bytes of data, a power of two
+  uint8_t pad0[48];
+  uint64_t head;      // bytes written, only advanced by branchExt
+  uint32_t done;      // branchExt has written the whole trace
+  uint8_t pad1[52];
+  uint64_t tail;      // bytes read, only advanced by the simulator
+  uint8_t pad2[56];
+} trace_shm_header;
+
+#endif
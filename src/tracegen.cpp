@@ -0,0 +1,586 @@
+//========================================================//
+//  tracegen.cpp                                          //
+//  Synthetic branch trace generator                      //
+//                                                        //
+//  Writes text or binary traces in the branchExt format  //
+//  from simple program models, together with the '.txt'  //
+//  sidecar and the misprediction rate an optimal       //
+//  predictor achieves                                  //
+//========================================================//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "trace_format.h"
+
+//------------------------------------//
+//        Generator Defines           //
+//------------------------------------//
+
+// Program models
+#define MODEL_LOOPS 0       // nested counted loops
+#define MODEL_CORRELATED 1  // a random branch repeated 'distance' branches later
+#define MODEL_BIASED 2      // independent branches taken with a fixed probability
+#define MODEL_CALLS 3       // recursive call/return trees
+#define MODEL_SWITCH 4      // interpreter loop with an indirect switch dispatch
+#define NUM_MODELS 5
+#define MODEL_MIX NUM_MODELS
+
+#define CHUNK_BRANCHES (1 << 16)  // conditional branches generated per work item
+// Output buffer per work item: at most 4 text lines of < 32 bytes (or
+// 4 binary records of 24 bytes) per conditional branch, plus one kernel
+// of slack
+#define CHUNK_BYTES (CHUNK_BRANCHES * 128 + (64 << 10))
+
+const char *modelName[NUM_MODELS + 1] = {"loops", "correlated", "biased", "calls", "switch", "mix"};
+
+// Conditional branch sites used by one kernel of each model
+int kernelSites[NUM_MODELS];
+
+//------------------------------------//
+//      Generator Configuration       //
+//------------------------------------//
+
+uint64_t genBranches = 10000000;  // conditional branches to generate
+int genModel = MODEL_MIX;
+uint32_t genStatic = 4096;        // target static conditional branch footprint
+uint32_t genDistance = 8;         // history distance of the correlated model
+double genBias = 0.9;             // taken probability of the biased model
+int genInstsPerBranch = 6;        // synthetic instructions per trace record
+int genThreads = 4;
+uint64_t genSeed = 1;
+const char *genOutput = NULL;     // trace file, stdout if NULL
+int genBinary = 0;                // write the binary format of trace_format.h
+
+uint32_t kernelsPerModel;
+
+//------------------------------------//
+//     Generator Data Structures      //
+//------------------------------------//
+
+// State of the generation of one chunk
+typedef struct
+{
+  uint64_t rng;
+  char *out;
+  size_t len;
+  uint64_t cond;
+  uint64_t uncond;
+  uint64_t calls;
+  uint64_t rets;
+  double optimal;   // expected mispredictions of an optimal predictor
+} gen_chunk;
+
+// Work items are handed to the workers through a ring of slots, and
+// written by the main thread in chunk order
+typedef struct
+{
+  gen_chunk chunk;
+  int ready;
+} gen_slot;
+
+gen_slot *slots;
+int numSlots;
+uint64_t numChunks;
+uint64_t nextChunk;     // next chunk a worker will generate
+uint64_t writtenChunks; // chunks already written out
+
+pthread_mutex_t gen_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gen_cond = PTHREAD_COND_INITIALIZER;
+
+//------------------------------------//
+//       Generator Functions          //
+//------------------------------------//
+
+void usage()
+{
+  fprintf(stderr, "Usage: tracegen <options>\n");
+  fprintf(stderr, "       tracegen <options> | predictor --<type>\n");
+  fprintf(stderr, " Options:\n");
+  fprintf(stderr, " --help            Print this message\n");
+  fprintf(stderr, " --branches=N      Conditional branches to generate (default 10000000)\n");
+  fprintf(stderr, " --model=<model>   loops, correlated, biased, calls, switch or mix (default)\n");
+  fprintf(stderr, " --static=N        Target static conditional branch footprint (default 4096)\n");
+  fprintf(stderr, " --distance=N      History distance of correlated branches (default 8)\n");
+  fprintf(stderr, " --bias=P          Taken probability of biased branches (default 0.9)\n");
+  fprintf(stderr, " --threads=N       Generator threads (default 4)\n");
+  fprintf(stderr, " --seed=N          Random seed (default 1)\n");
+  fprintf(stderr, " --out=<trace>     Write <trace> and <trace>.txt instead of stdout\n");
+  fprintf(stderr, " --binary          Write a binary trace (trace_format.h) instead of text\n");
+}
+
+static inline uint64_t next_random(gen_chunk *c)
+{
+  // xorshift64*
+  c->rng ^= c->rng >> 12;
+  c->rng ^= c->rng << 25;
+  c->rng ^= c->rng >> 27;
+  return c->rng * 2685821657736338717ull;
+}
+
+static inline uint64_t mix_hash(uint64_t x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return x;
+}
+
+static inline char *put_hex(char *p, uint32_t v)
+{
+  static const char digits[] = "0123456789abcdef";
+  char tmp[8];
+  int n = 0;
+  do
+  {
+    tmp[n++] = digits[v & 0xf];
+    v >>= 4;
+  } while (v != 0);
+
+  *p++ = '0';
+  *p++ = 'x';
+  while (n > 0)
+  {
+    *p++ = tmp[--n];
+  }
+  return p;
+}
+
+// Appends one trace record in the branchExt format, text or binary
+//
+static inline void emit(gen_chunk *c, uint32_t pc, uint32_t target, int taken, int cond, int call, int ret, int direct)
+{
+  if (genBinary)
+  {
+    trace_record r;
+    r.pc = pc;
+    r.target = target;
+    r.flags = (taken ? TRACE_TAKEN : 0) | (cond ? TRACE_COND : 0) | (call ? TRACE_CALL : 0) |
+              (ret ? TRACE_RET : 0) | (direct ? TRACE_DIRECT : 0);
+    r.insts = genInstsPerBranch;
+    r.length = 0;  // the models have no instruction sizes
+    r.reserved = 0;
+    memcpy(c->out + c->len, &r, sizeof(r));
+    c->len += sizeof(r);
+  }
+  else
+  {
+    char *p = c->out + c->len;
+    p = put_hex(p, pc);
+    *p++ = '\t';
+    p = put_hex(p, target);
+    *p++ = '\t';
+    *p++ = '0' + taken;
+    *p++ = '\t';
+    *p++ = '0' + cond;
+    *p++ = '\t';
+    *p++ = '0' + call;
+    *p++ = '\t';
+    *p++ = '0' + ret;
+    *p++ = '\t';
+    *p++ = '0' + direct;
+    *p++ = '\n';
+    c->len = p - c->out;
+  }
+
+  if (cond)
+  {
+    c->cond++;
+  }
+  else
+  {
+    c->uncond++;
+    c->calls += call;
+    c->rets += ret;
+  }
+}
+
+static inline uint32_t kernel_base(int model, uint32_t k)
+{
+  return 0x400000 + ((uint32_t)model << 24) + (k << 8);
+}
+
+// Nested loops with trip counts fixed per kernel: fully predictable
+// by a predictor that can see a whole inner loop in its history
+//
+static void gen_loops(gen_chunk *c, uint32_t k)
+{
+  uint32_t base = kernel_base(MODEL_LOOPS, k);
+  uint32_t inner = 2 + mix_hash(k) % 15;
+  uint32_t outer = 2 + mix_hash(k + 1) % 7;
+
+  for (uint32_t o = 0; o < outer; o++)
+  {
+    for (uint32_t i = 0; i < inner; i++)
+    {
+      emit(c, base + 0x10, base, i != inner - 1, 1, 0, 0, 1);
+    }
+    emit(c, base + 0x20, base, o != outer - 1, 1, 0, 0, 1);
+  }
+}
+
+// A random branch, 'distance - 1' always-taken branches, and a branch
+// with the same outcome as the first one: only the first is unpredictable
+//
+static void gen_correlated(gen_chunk *c, uint32_t k)
+{
+  uint32_t base = kernel_base(MODEL_CORRELATED, k);
+  int first = next_random(c) & 1;
+
+  emit(c, base, base + 0x80, first, 1, 0, 0, 1);
+  for (uint32_t i = 1; i < genDistance; i++)
+  {
+    emit(c, base + 4 * i, base + 4 * i + 2, 1, 1, 0, 0, 1);
+  }
+  emit(c, base + 4 * genDistance, base + 0x80, first, 1, 0, 0, 1);
+  c->optimal += 0.5;
+}
+
+// Eight independent branches, each taken with probability 'bias' or
+// '1 - bias': an optimal predictor mispredicts min(bias, 1 - bias)
+//
+static void gen_biased(gen_chunk *c, uint32_t k)
+{
+  uint32_t base = kernel_base(MODEL_BIASED, k);
+  uint64_t threshold = (uint64_t)(genBias * 4294967296.0);
+  double miss = (genBias < 0.5) ? genBias : 1 - genBias;
+
+  for (uint32_t i = 0; i < 8; i++)
+  {
+    uint32_t pc = base + 8 * i;
+    int taken = (next_random(c) >> 32) < threshold;
+    if (mix_hash(pc) & 1)
+    {
+      taken = !taken;
+    }
+    emit(c, pc, pc + 0x40, taken, 1, 0, 0, 1);
+    c->optimal += miss;
+  }
+}
+
+// Recursive function calling itself twice until a depth fixed per kernel.
+// Each level has its own base-case branch: fully predictable
+//
+static void gen_calls_level(gen_chunk *c, uint32_t base, uint32_t depth, uint32_t max_depth, uint32_t ret_addr)
+{
+  uint32_t fn = base + depth * 0x20;
+  int recurse = depth < max_depth;
+
+  emit(c, fn, fn + 0x18, !recurse, 1, 0, 0, 1);
+  if (recurse)
+  {
+    uint32_t child = base + (depth + 1) * 0x20;
+    emit(c, fn + 0x8, child, 1, 0, 1, 0, 1);
+    gen_calls_level(c, base, depth + 1, max_depth, fn + 0xd);
+    emit(c, fn + 0xd, child, 1, 0, 1, 0, 1);
+    gen_calls_level(c, base, depth + 1, max_depth, fn + 0x12);
+  }
+  emit(c, fn + 0x1c, ret_addr, 1, 0, 0, 1, 0);
+}
+
+static void gen_calls(gen_chunk *c, uint32_t k)
+{
+  uint32_t base = kernel_base(MODEL_CALLS, k);
+  uint32_t max_depth = 2 + mix_hash(k) % (kernelSites[MODEL_CALLS] - 2);
+
+  emit(c, base - 0x10, base, 1, 0, 1, 0, 1);
+  gen_calls_level(c, base, 0, max_depth, base - 0xb);
+}
+
+// Interpreter loop: an indirect jump to one of 8 random opcodes, whose
+// case has a branch with a fixed outcome, and a counted back-edge
+//
+static void gen_switch(gen_chunk *c, uint32_t k)
+{
+  uint32_t base = kernel_base(MODEL_SWITCH, k);
+  uint32_t trips = 16 + mix_hash(k) % 48;
+
+  for (uint32_t i = 0; i < trips; i++)
+  {
+    uint32_t op = next_random(c) & 7;
+    uint32_t handler = base + 0x40 + op * 0x10;
+    emit(c, base + 0x4, handler, 1, 0, 0, 0, 0);
+    emit(c, handler, handler + 0x8, op & 1, 1, 0, 0, 1);
+    emit(c, handler + 0xc, base + 0x30, 1, 0, 0, 0, 1);
+    emit(c, base + 0x30, base, i != trips - 1, 1, 0, 0, 1);
+  }
+}
+
+// Generates one chunk of at least 'branches' conditional branches
+//
+static void gen_run(gen_chunk *c, uint64_t chunk, uint64_t branches)
+{
+  c->rng = mix_hash(genSeed * 0x9e3779b97f4a7c15ull + chunk) | 1;
+  c->len = 0;
+  c->cond = 0;
+  c->uncond = 0;
+  c->calls = 0;
+  c->rets = 0;
+  c->optimal = 0;
+
+  while (c->cond < branches)
+  {
+    uint64_t r = next_random(c);
+    int model = (genModel == MODEL_MIX) ? (int)((r >> 32) % NUM_MODELS) : genModel;
+    uint32_t k = (uint32_t)r % kernelsPerModel;
+
+    switch (model)
+    {
+    case MODEL_LOOPS:
+      gen_loops(c, k);
+      break;
+    case MODEL_CORRELATED:
+      gen_correlated(c, k);
+      break;
+    case MODEL_BIASED:
+      gen_biased(c, k);
+      break;
+    case MODEL_CALLS:
+      gen_calls(c, k);
+      break;
+    case MODEL_SWITCH:
+      gen_switch(c, k);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+static void *gen_worker(void *)
+{
+  while (1)
+  {
+    pthread_mutex_lock(&gen_lock);
+    // wait until the slot of the next chunk has been written out
+    while (nextChunk < numChunks && nextChunk >= writtenChunks + numSlots)
+    {
+      pthread_cond_wait(&gen_cond, &gen_lock);
+    }
+    uint64_t chunk = nextChunk;
+    if (chunk >= numChunks)
+    {
+      pthread_mutex_unlock(&gen_lock);
+      break;
+    }
+    nextChunk++;
+    pthread_mutex_unlock(&gen_lock);
+
+    gen_slot *slot = &slots[chunk % numSlots];
+    uint64_t branches = (chunk == numChunks - 1) ? genBranches - chunk * CHUNK_BRANCHES : CHUNK_BRANCHES;
+    gen_run(&slot->chunk, chunk, branches);
+
+    pthread_mutex_lock(&gen_lock);
+    slot->ready = 1;
+    pthread_cond_broadcast(&gen_cond);
+    pthread_mutex_unlock(&gen_lock);
+  }
+
+  return NULL;
+}
+
+int handle_option(char *arg)
+{
+  if (!strncmp(arg, "--branches=", 11))
+  {
+    genBranches = strtoull(arg + 11, NULL, 0);
+  }
+  else if (!strncmp(arg, "--model=", 8))
+  {
+    for (genModel = 0; genModel <= MODEL_MIX; genModel++)
+    {
+      if (!strcmp(arg + 8, modelName[genModel]))
+      {
+        return 1;
+      }
+    }
+    return 0;
+  }
+  else if (!strncmp(arg, "--static=", 9))
+  {
+    genStatic = strtoul(arg + 9, NULL, 0);
+  }
+  else if (!strncmp(arg, "--distance=", 11))
+  {
+    genDistance = strtoul(arg + 11, NULL, 0);
+  }
+  else if (!strncmp(arg, "--bias=", 7))
+  {
+    genBias = atof(arg + 7);
+  }
+  else if (!strncmp(arg, "--threads=", 10))
+  {
+    genThreads = atoi(arg + 10);
+  }
+  else if (!strncmp(arg, "--seed=", 7))
+  {
+    genSeed = strtoull(arg + 7, NULL, 0);
+  }
+  else if (!strncmp(arg, "--out=", 6))
+  {
+    genOutput = arg + 6;
+  }
+  else if (!strcmp(arg, "--binary"))
+  {
+    genBinary = 1;
+  }
+  else
+  {
+    return 0;
+  }
+
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "--help"))
+    {
+      usage();
+      exit(0);
+    }
+    else if (!handle_option(argv[i]))
+    {
+      fprintf(stderr, "Unrecognized option %s\n", argv[i]);
+      usage();
+      exit(1);
+    }
+  }
+  if (genThreads < 1)
+  {
+    genThreads = 1;
+  }
+  if (genDistance < 1 || genDistance > 48)
+  {
+    fprintf(stderr, "--distance must be between 1 and 48\n");
+    exit(1);
+  }
+
+  // size the kernels so all models together cover the target footprint
+  kernelSites[MODEL_LOOPS] = 2;
+  kernelSites[MODEL_CORRELATED] = genDistance + 1;
+  kernelSites[MODEL_BIASED] = 8;
+  kernelSites[MODEL_CALLS] = 6;
+  kernelSites[MODEL_SWITCH] = 9;
+  uint32_t sites = 0;
+  for (int m = 0; m < NUM_MODELS; m++)
+  {
+    if (genModel == MODEL_MIX || genModel == m)
+    {
+      sites += kernelSites[m];
+    }
+  }
+  kernelsPerModel = (genStatic + sites - 1) / sites;
+  if (kernelsPerModel == 0)
+  {
+    kernelsPerModel = 1;
+  }
+  if (kernelsPerModel > (1 << 16))
+  {
+    fprintf(stderr, "--static is too large\n");
+    exit(1);
+  }
+
+  FILE *out = stdout;
+  if (genOutput != NULL && (out = fopen(genOutput, "w")) == NULL)
+  {
+    fprintf(stderr, "Could not open %s\n", genOutput);
+    exit(1);
+  }
+
+  if (genBinary)
+  {
+    trace_header header = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record), 0};
+    fwrite(&header, sizeof(header), 1, out);
+  }
+
+  numChunks = (genBranches + CHUNK_BRANCHES - 1) / CHUNK_BRANCHES;
+  numSlots = 2 * genThreads;
+  slots = (gen_slot *)calloc(numSlots, sizeof(gen_slot));
+  for (int i = 0; i < numSlots; i++)
+  {
+    slots[i].chunk.out = (char *)malloc(CHUNK_BYTES);
+  }
+
+  pthread_t *workers = (pthread_t *)malloc(genThreads * sizeof(pthread_t));
+  for (int i = 0; i < genThreads; i++)
+  {
+    pthread_create(&workers[i], NULL, gen_worker, NULL);
+  }
+
+  // write the chunks out in order as they become ready
+  uint64_t cond = 0, uncond = 0, calls = 0, rets = 0;
+  double optimal = 0;
+  for (uint64_t chunk = 0; chunk < numChunks; chunk++)
+  {
+    gen_slot *slot = &slots[chunk % numSlots];
+    pthread_mutex_lock(&gen_lock);
+    while (!slot->ready)
+    {
+      pthread_cond_wait(&gen_cond, &gen_lock);
+    }
+    pthread_mutex_unlock(&gen_lock);
+
+    fwrite(slot->chunk.out, 1, slot->chunk.len, out);
+    cond += slot->chunk.cond;
+    uncond += slot->chunk.uncond;
+    calls += slot->chunk.calls;
+    rets += slot->chunk.rets;
+    optimal += slot->chunk.optimal;
+
+    pthread_mutex_lock(&gen_lock);
+    slot->ready = 0;
+    writtenChunks++;
+    pthread_cond_broadcast(&gen_cond);
+    pthread_mutex_unlock(&gen_lock);
+  }
+
+  for (int i = 0; i < genThreads; i++)
+  {
+    pthread_join(workers[i], NULL);
+  }
+  if (out != stdout)
+  {
+    fclose(out);
+  }
+
+  // Sidecar in the branchExt format, plus what an optimal predictor achieves
+  FILE *info = stderr;
+  char info_path[4096];
+  if (genOutput != NULL)
+  {
+    snprintf(info_path, sizeof(info_path), "%s.txt", genOutput);
+    if ((info = fopen(info_path, "w")) == NULL)
+    {
+      fprintf(stderr, "Could not open %s\n", info_path);
+      exit(1);
+    }
+  }
+  fprintf(info, "!!! Number of Instructions = %llu\n", (unsigned long long)((cond + uncond) * genInstsPerBranch));
+  fprintf(info, "!!! Number of Unconditional branches = %llu\n", (unsigned long long)uncond);
+  fprintf(info, "!!! Number of Conditional branches = %llu\n", (unsigned long long)cond);
+  fprintf(info, "!!! Number of Call branches = %llu\n", (unsigned long long)calls);
+  fprintf(info, "!!! Number of Ret branches = %llu\n", (unsigned long long)rets);
+  fprintf(info, "!!! Model = %s\n", modelName[genModel]);
+  fprintf(info, "!!! Static conditional branches = %u\n", kernelsPerModel * sites);
+  fprintf(info, "!!! Optimal Misprediction Rate = %.3f\n", 1000 * optimal / (double)cond);
+  if (info != stderr)
+  {
+    fclose(info);
+  }
+
+  for (int i = 0; i < numSlots; i++)
+  {
+    free(slots[i].chunk.out);
+  }
+  free(slots);
+  free(workers);
+
+  return 0;
+}